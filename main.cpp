@@ -1,19 +1,47 @@
+#include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bitset>
 #include <cerrno>
+#include <charconv>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <format>
+#include <future>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <span>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CS_X86_KERNELS
+#endif
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && \
+    defined(__NR_io_uring_register)
+#define CS_HAVE_URING
+#endif
+#endif
+
 bool logging = false;
 
 // Global variables for spinners
@@ -58,95 +86,438 @@ void startSpinner(std::string spinningMessage, std::string doneMessage) {
 
 void stopSpinner() {
     spinning = false;
-    spinnerThread.join();
+    if (spinnerThread.joinable())
+        spinnerThread.join();
 }
 
-// Forwards
-struct CSSym;
-struct CSFile;
-struct CSFuncCall;
+// Dense ID of a function name, see CSInterner
+typedef uint32_t CSNameId;
+static constexpr CSNameId cs_no_name = UINT32_MAX;
+
+// Holds copies of the symbol names that cannot point into the database,
+// either because it is not kept mapped or because the name had to be
+// decompressed.  Copies are packed one after another into large blocks,
+// which keeps the names compared while interning dense, and they are all
+// released at once with the pool.
+class CSStringPool {
+   public:
+    std::string_view copy(std::string_view name) {
+        size_t len = name.size();
+        if (_blocks.empty() || len > _block_len - _used) {
+            _block_len = std::max(len, block_size);
+            _blocks.emplace_back(new char[_block_len]);
+            _reserved += _block_len;
+            _used = 0;
+        }
+        char* dst = _blocks.back().get() + _used;
+        memcpy(dst, name.data(), len);
+        _used += len;
+        _bytes += len;
+        return std::string_view(dst, len);
+    }
+
+    size_t bytes() const { return _bytes; }        // Handed out
+    size_t reserved() const { return _reserved; }  // Held in blocks
+
+   private:
+    static constexpr size_t block_size = 256 * 1024;
 
-// Hash of symbols
-typedef std::unordered_map<std::string, const CSSym*> CSSymHash;
-typedef std::unordered_map<std::string, std::vector<const CSFuncCall*>> CSDB;
+    std::vector<std::unique_ptr<char[]>> _blocks;
+    size_t _block_len = 0;
+    size_t _used = 0;  // In the last block
+    size_t _bytes = 0, _reserved = 0;
+};
 
-// Symbol: could be a function definition or function call
-class CSSym {
+// Gives every distinct function name a dense ID, in the order the names are
+// added.  Everything past parsing works on IDs, names are only looked up
+// again for output.  Names are views into the mapped database or into a
+// CSStringPool.  Lookups happen for every symbol parsed, so the table is open
+// addressed and keeps part of each hash to avoid touching most names.
+class CSInterner {
    public:
-    CSSym(const char* name, char mark, size_t line, const CSFile* file)
-        : _name(name), _mark(mark), _line(line), _file(file) {}
+    // The ID of 'name', or cs_no_name if it has none
+    CSNameId find(std::string_view name) const {
+        if (_slots.empty())
+            return cs_no_name;
+        size_t hash = std::hash<std::string_view>()(name);
+        for (size_t i = hash & _mask;; i = (i + 1) & _mask) {
+            const Slot& slot = _slots[i];
+            if (slot.id == cs_no_name)
+                return cs_no_name;
+            if (slot.tag == (uint32_t)(hash >> 32) && _names[slot.id] == name)
+                return slot.id;
+        }
+    }
+
+    // Give 'name' the next ID.  'name' must not have one yet.
+    CSNameId add(std::string_view name) {
+        // Stay at most half full
+        if (2 * (_names.size() + 1) > _slots.size())
+            grow();
+        CSNameId id = _names.size();
+        _names.push_back(name);
+        insert(std::hash<std::string_view>()(name), id);
+        return id;
+    }
 
-    char getMark() const { return _mark; }
-    virtual std::string getName() const { return _name; }
+    std::string_view name(CSNameId id) const { return _names[id]; }
+    size_t size() const { return _names.size(); }
 
    private:
-    std::string _name;
-    char _mark;
-    size_t _line;
-    const CSFile* _file;
-    CSSymHash _fn_defs;  // Function definitions
+    struct Slot {
+        uint32_t tag = 0;  // The high bits of the hash
+        CSNameId id = cs_no_name;
+    };
+    std::vector<Slot> _slots;
+    size_t _mask = 0;
+    std::vector<std::string_view> _names;
+
+    void insert(size_t hash, CSNameId id) {
+        size_t i = hash & _mask;
+        while (_slots[i].id != cs_no_name)
+            i = (i + 1) & _mask;
+        _slots[i] = {(uint32_t)(hash >> 32), id};
+    }
+
+    void grow() {
+        _slots.assign(std::max<size_t>(1024, _slots.size() * 2), Slot());
+        _mask = _slots.size() - 1;
+        for (CSNameId id = 0; id < _names.size(); ++id)
+            insert(std::hash<std::string_view>()(_names[id]), id);
+    }
+};
+
+#define CS_FN_DEF '$'
+#define CS_FN_CALL '`'
+
+// Symbol: could be a function definition or function call.  A CS keeps its
+// symbols in one array, in database order, with each definition followed by
+// the calls it makes.
+struct CSSym {
+    CSNameId id;
+    uint32_t file;  // Index in CS::files
+    uint32_t line;
+    char mark;
 };
+static_assert(sizeof(CSSym) == 16);
+
+// Index of a symbol in its array
+typedef size_t CSSymIdx;
+static constexpr CSSymIdx cs_no_sym = SIZE_MAX;
+
+// The calls made by the definition at 'def', unique and in the order they
+// are first made
+static inline std::span<const CSSym> getCallees(std::span<const CSSym> syms,
+                                                CSSymIdx def) {
+    CSSymIdx end = def + 1;
+    while (end < syms.size() && syms[end].mark == CS_FN_CALL)
+        ++end;
+    return syms.subspan(def + 1, end - def - 1);
+}
+
+static inline bool hasCallee(std::span<const CSSym> syms,
+                             CSSymIdx def,
+                             CSNameId id) {
+    for (const CSSym& callee : getCallees(syms, def))
+        if (callee.id == id)
+            return true;
+    return false;
+}
+
+// A file entry: its path and its symbols, [syms_begin, syms_end) of the
+// symbol array.  Later definitions of a name already defined in a file still
+// collect calls, but never become the name's entry.
+struct CSFile {
+    std::string_view name;
+    CSSymIdx syms_begin;
+    CSSymIdx syms_end;
+};
+
+// Each function's database entry by name ID: the index of its first
+// definition in the first file that defines it, or cs_no_sym
+typedef std::vector<CSSymIdx> CSDB;
 
-// Symbol: could be a function definition or function call
-class CSFuncCall : public CSSym {
+// Which way a traversal follows calls
+enum CSDirection { CS_CALLERS, CS_CALLEES };
+
+// The call graph, built once from the database entries, in compressed sparse
+// row form: the callees of function 'id' are the IDs in
+// _targets[_offsets[id]] up to _targets[_offsets[id + 1]], in the order the
+// calls are first made.  The callers of each function are kept the same way,
+// in ID order, so that finding them takes time in its number of callers.
+class CSGraph {
    public:
-    CSFuncCall(const char* name, char mark, size_t line, const CSFile* file)
-        : CSSym(name, mark, line, file) {}
+    CSGraph() : _offsets(1, 0), _rev_offsets(1, 0) {}
+
+    CSGraph(const CSDB& db, std::span<const CSSym> syms) {
+        _offsets.reserve(db.size() + 1);
+        _offsets.push_back(0);
+        for (CSSymIdx def : db) {
+            if (def != cs_no_sym)
+                for (const CSSym& callee : getCallees(syms, def))
+                    _targets.push_back(callee.id);
+            _offsets.push_back(_targets.size());
+        }
+
+        // Count each function's callers, then place them, going through
+        // the callers in ID order
+        _rev_offsets.assign(db.size() + 1, 0);
+        for (CSNameId callee : _targets)
+            ++_rev_offsets[callee + 1];
+        for (size_t id = 0; id < db.size(); ++id)
+            _rev_offsets[id + 1] += _rev_offsets[id];
+        _rev_targets.resize(_targets.size());
+        std::vector<uint32_t> next(_rev_offsets.begin(),
+                                   _rev_offsets.end() - 1);
+        for (CSNameId id = 0; id < db.size(); ++id)
+            for (CSNameId callee : callees(id))
+                _rev_targets[next[callee]++] = id;
+    }
+
+    // Number of names, defined or not
+    size_t size() const { return _offsets.size() - 1; }
+
+    std::span<const CSNameId> callees(CSNameId id) const {
+        return {_targets.data() + _offsets[id],
+                _targets.data() + _offsets[id + 1]};
+    }
+
+    std::span<const CSNameId> callers(CSNameId id) const {
+        return {_rev_targets.data() + _rev_offsets[id],
+                _rev_targets.data() + _rev_offsets[id + 1]};
+    }
+
+    // The functions one call away from 'id' in direction 'dir'
+    std::span<const CSNameId> next(CSDirection dir, CSNameId id) const {
+        return dir == CS_CALLERS ? callers(id) : callees(id);
+    }
+
+   private:
+    std::vector<uint32_t> _offsets;
+    std::vector<CSNameId> _targets;
+    std::vector<uint32_t> _rev_offsets;
+    std::vector<CSNameId> _rev_targets;
 };
 
-// Symbol: could be a function definition or function call
-class CSFuncDef : public CSSym {
+// Level-synchronous breadth-first traversal of a CSGraph, in either
+// direction.  A function is expanded once, at the level it is first reached,
+// so each edge is followed once and the work and memory follow the reachable
+// subgraph.  Large levels are split into blocks that threads take in turn,
+// each visiting its edges into a part of the output of its own.  Functions
+// are claimed in an atomic bitmap, each level is ordered by ID before it is
+// expanded, and the parts are joined in block order, so the output is the
+// same whatever the number of threads.  The bitmap is sized for the whole
+// graph once, and each run clears only what it reached, so a traversal
+// kept for the next query costs that query nothing to set up.
+class CSTraversal {
    public:
-    CSFuncDef(const char* name, char mark, size_t line, const CSFile* file)
-        : CSSym(name, mark, line, file) {}
+    explicit CSTraversal(const CSGraph& graph)
+        : _graph(graph), _seen((graph.size() + 63) / 64) {}
+
+    // Call 'visit(part, id, next)' for each edge followed from a function
+    // 'id' within 'depth' levels of the functions 'fns', a level at a time,
+    // on one of 'jobs' threads.  'part' is the Part of the edge's block,
+    // which is then handed to 'join(part)' on the calling thread, block by
+    // block in order.  'fns' must be in ID order, without repeats.
+    template <typename Part, typename Visit, typename Join>
+    void run(std::span<const CSNameId> fns,
+             int depth,
+             CSDirection dir,
+             unsigned jobs,
+             Visit visit,
+             Join join);
 
-    void getCallees(std::vector<const CSFuncCall*>& addem) const {
-        for (auto callee : _callees)
-            addem.push_back(static_cast<const CSFuncCall*>(callee.second));
+   private:
+    // Levels smaller than this are expanded on one thread
+    static constexpr size_t block_size = 1024;
+
+    const CSGraph& _graph;
+    std::vector<std::atomic<uint64_t>> _seen;
+    std::vector<CSNameId> _frontier, _reached;
+    std::vector<std::vector<CSNameId>> _found;  // By each block of a level
+
+    // Set the bit of 'id', returning whether this call set it
+    bool claim(CSNameId id) {
+        uint64_t bit = 1ull << (id % 64);
+        return !(_seen[id / 64].fetch_or(bit, std::memory_order_relaxed) &
+                 bit);
     }
+};
+
+// Strongly connected components of a CSGraph, found once with an iterative
+// Tarjan's algorithm.  The functions of a cycle share a component, every
+// other function is a component of its own.
+class CSComponents {
+   public:
+    CSComponents() = default;
+    explicit CSComponents(const CSGraph& graph);
 
-    // Unique add
-    void addCallee(const CSFuncCall* fncall) {
-        auto pr = std::make_pair<std::string, const CSSym*>(fncall->getName(),
-                                                            fncall);
-        _callees.insert(pr);
+    uint32_t of(CSNameId id) const { return _component[id]; }
+
+    // The functions of component 'c', in ID order
+    std::span<const CSNameId> members(uint32_t c) const {
+        return {_members.data() + _offsets[c],
+                _members.data() + _offsets[c + 1]};
     }
 
+    size_t size() const { return _offsets.size() - 1; }
+
+   private:
+    std::vector<uint32_t> _component;
+    std::vector<uint32_t> _offsets;
+    std::vector<CSNameId> _members;
+};
+
+// Call chains between two functions of a CSGraph
+class CSPaths {
+   public:
+    explicit CSPaths(const CSGraph& graph) : _graph(graph) {}
+
+    // The functions on the shortest call chains from 'from' to 'to', by
+    // their place in the chain: the first level is 'from' and the last is
+    // 'to'.  Empty when 'to' cannot be reached.  A bidirectional BFS grows
+    // whichever side has the smaller frontier, over callees from 'from' and
+    // callers from 'to', until they meet.
+    std::vector<std::vector<CSNameId>> shortest(CSNameId from, CSNameId to);
+
+    // A call chain, from its first function to its last
+    typedef std::vector<CSNameId> Chain;
+
+    // The 'count' shortest chains from 'from' to 'to' that repeat no
+    // function and make at most 'length' calls, shortest first, found with
+    // Yen's algorithm.  Ties are broken by function IDs.
+    std::vector<Chain> kShortest(CSNameId from,
+                                 CSNameId to,
+                                 size_t count,
+                                 uint32_t length);
+
+    // Up to 'count' chains from 'from' to 'to' that repeat no function and
+    // make at most 'length' calls, depth first.  Functions that cannot reach
+    // 'to' with the calls left are never entered.
+    std::vector<Chain> simple(CSNameId from,
+                              CSNameId to,
+                              size_t count,
+                              uint32_t length);
+
    private:
-    CSSymHash _callees;  // Function calls
+    const CSGraph& _graph;
+
+    // Functions marked in the current round count as visited.  Rounds avoid
+    // clearing the marks between the searches of kShortest().
+    std::vector<uint32_t> _mark;
+    std::vector<CSNameId> _parent;
+    uint32_t _round = 0;
+    std::vector<CSNameId> _callees;  // Of the function being expanded
+
+    // Find a shortest chain from 'from' to 'to' of at most 'length' calls,
+    // avoiding the functions 'banned' and the calls from 'from' to
+    // 'banned_next'.  Callees are followed in ID order, so the chain found
+    // is the first by IDs of the shortest ones.
+    bool shortestChain(CSNameId from,
+                       CSNameId to,
+                       uint32_t length,
+                       std::span<const CSNameId> banned,
+                       std::span<const CSNameId> banned_next,
+                       Chain& chain);
 };
 
-// A file entry contains a list of symbols, we only collect function calls here.
-class CSFile {
+// Whether 'name' is a pattern for the functions starting with what comes
+// before its trailing '*'
+static inline bool isPrefixPattern(std::string_view name) {
+    return name.ends_with('*') && name.find('*') == name.size() - 1;
+}
+
+// A regular expression over function names, compiled to a DFA.  It takes
+// the POSIX extended syntax that names need: literals, '.', bracket
+// expressions with ranges, grouping, '|', '*', '+' and '?'.  '^' and '$'
+// anchor only at the ends of the pattern, and without them a match may
+// start or end anywhere in the name, as with grep.  Bytes that no part of
+// the pattern tells apart share a column of the transition table.
+class CSRegex {
    public:
-    CSFile(const char* name, char mark)
-        : _name(name), _mark(mark), _current_fndef(nullptr) {}
+    // Compile 'pattern', or return false with the reason in 'error'
+    bool compile(std::string_view pattern, std::string& error);
 
-    CSFuncDef* getCurrentFunction() const { return _current_fndef; }
-    std::string getName() const { return _name; }
-    const CSSymHash* getFunctions() { return &_functions; }
-    size_t getFunctionCount() const { return _functions.size(); }
+    uint32_t start() const { return _start; }
 
-    void addFunctionDef(CSFuncDef* fndef) {
-        auto pr =
-            std::make_pair<std::string, const CSSym*>(fndef->getName(), fndef);
-        _functions.insert(pr);
-        _current_fndef = fndef;
+    uint32_t next(uint32_t state, char c) const {
+        return _table[state * _n_classes + _classes[(uint8_t)c]];
     }
 
+    // Whether a name that leaves the DFA in 'state' matches
+    bool accepts(uint32_t state) const { return _accepting[state]; }
+
    private:
-    std::string _name;
-    char _mark;
-    CSSymHash _functions;
+    // Patterns needing more states than this are refused
+    static constexpr size_t max_states = 4096;
+
+    std::array<uint8_t, 256> _classes = {};
+    size_t _n_classes = 0;
+    std::vector<uint32_t> _table;
+    std::vector<bool> _accepting;
+    uint32_t _start = 0;
+};
+
+// The names of the defined functions in sorted order, front coded: each name
+// is stored as the length it shares with the name before it, the length of
+// the rest, then the rest.  Every 'bucket_size' names a bucket starts with a
+// name stored in full, so that buckets can be binary searched by their first
+// name and scanned independently.
+class CSNameIndex {
+   public:
+    CSNameIndex() = default;
+    // Index the names of 'ids', sorting them on 'jobs' threads
+    CSNameIndex(const CSInterner& symbols,
+                std::span<const CSNameId> ids,
+                unsigned jobs);
+
+    // The IDs of the names starting with 'prefix', in ID order
+    std::vector<CSNameId> prefixed(std::string_view prefix) const;
+
+    // The IDs of the names 're' matches, in ID order.  Buckets are scanned
+    // on 'jobs' threads, and a name resumes the DFA from where the prefix
+    // it shares with the name before it left it.
+    std::vector<CSNameId> matching(const CSRegex& re, unsigned jobs) const;
+
+    size_t size() const { return _ids.size(); }
 
-    // The current function being added to (callees being added).
-    CSFuncDef* _current_fndef;
+   private:
+    static constexpr size_t bucket_size = 16;
+
+    // Buckets scanned at a time by matching()
+    static constexpr size_t scan_buckets = 1024;
+
+    std::vector<char> _bytes;
+    std::vector<size_t> _buckets;  // Offset of each bucket in _bytes
+    std::vector<CSNameId> _ids;    // In name order
+
+    static void putLength(std::vector<char>& bytes, size_t len);
+    static size_t getLength(const char*& p);
+
+    // The first name of bucket 'b'
+    std::string_view head(size_t b) const;
+
+    // Call 'fn(i, shared, rest)' for name 'i' onwards from bucket 'begin'
+    // until bucket 'end' or until 'fn' returns false.  Name 'i' is its first
+    // 'shared' bytes in common with name i - 1, followed by 'rest'.
+    template <typename F>
+    void scan(size_t begin, size_t end, F fn) const {
+        const char* p = _bytes.data() + _buckets[begin];
+        size_t last = std::min(_ids.size(), end * bucket_size);
+        for (size_t i = begin * bucket_size; i < last; ++i) {
+            size_t shared = getLength(p);
+            size_t len = getLength(p);
+            if (!fn(i, shared, std::string_view(p, len)))
+                return;
+            p += len;
+        }
+    }
 };
 
 // cscope database (cscope.out) header
 struct CSHeader {
     int version;
-    bool compression;    /* -c */
+    bool compression;    /* unless -c */
     bool inverted_index; /* -q */
     bool prefix_match;   /* -T */
     size_t syms_start;
@@ -164,30 +535,405 @@ struct CSTrailer {
     char** incs;
 };
 
+// A reference to a symbol, from cscope's inverted index
+struct CSPosting {
+    size_t line_offset;  // Database offset of the referencing source line
+    char mark;           // Kind of reference
+};
+
+// Reader for cscope's inverted index (cscope -q).  It lives next to the
+// database: cscope.in.out maps each symbol to a run of postings in
+// cscope.po.out.  cscope writes both as raw structs, so only indexes built on
+// a host with the same word size and byte order can be read.
+class CSInvertedIndex {
+   public:
+    CSInvertedIndex() = default;
+    CSInvertedIndex(const CSInvertedIndex&) = delete;
+    CSInvertedIndex& operator=(const CSInvertedIndex&) = delete;
+    ~CSInvertedIndex();
+
+    // Map the index for the database at 'db_path'.  Returns false if it is
+    // missing or does not look like an index.
+    bool open(const char* db_path);
+
+    // All references to 'term'
+    std::vector<CSPosting> find(std::string_view term) const;
+
+   private:
+    const uint8_t* _inv = nullptr;  // cscope.in.out
+    size_t _inv_len = 0;
+    const uint8_t* _post = nullptr;  // cscope.po.out
+    size_t _post_len = 0;
+
+    // The superfinger holds the first term of each logical block
+    const uint8_t* _fingers = nullptr;
+    size_t _fingers_len = 0;
+    size_t _n_blocks = 0;
+    size_t _blocks_start = 0;
+    size_t _block_size = 0;
+
+    std::string_view fingerTerm(size_t i) const;
+};
+
+// Items grouped into a power of two of buckets by the low bits of their
+// 32-bit 'hash', about two to a bucket.  Each bucket keeps its items in the
+// order they were given.
+template <typename T>
+class CSHashBuckets {
+   public:
+    // Group the items of 'parts', one part after the other
+    void build(const std::vector<std::vector<T>>& parts) {
+        size_t n = 0;
+        for (const std::vector<T>& part : parts)
+            n += part.size();
+        size_t n_buckets = 1;
+        while (n_buckets * 2 < n)
+            n_buckets *= 2;
+        _mask = n_buckets - 1;
+
+        // Count the items of each bucket, then place them
+        _offsets.assign(n_buckets + 1, 0);
+        for (const std::vector<T>& part : parts)
+            for (const T& item : part)
+                ++_offsets[(item.hash & _mask) + 1];
+        for (size_t b = 0; b < n_buckets; ++b)
+            _offsets[b + 1] += _offsets[b];
+        _items.resize(n);
+        std::vector<uint32_t> next(_offsets.begin(), _offsets.end() - 1);
+        for (const std::vector<T>& part : parts)
+            for (const T& item : part)
+                _items[next[item.hash & _mask]++] = item;
+    }
+
+    // The items that may have 'hash'
+    std::span<const T> bucket(uint32_t hash) const {
+        size_t b = hash & _mask;
+        return {_items.data() + _offsets[b], _items.data() + _offsets[b + 1]};
+    }
+
+   private:
+    std::vector<uint32_t> _offsets = {0, 0};
+    size_t _mask = 0;
+    std::vector<T> _items;
+};
+
+// A quick pass over the symbol section that records where each file record
+// is, and the hashes of the functions it defines and calls.  It answers the
+// same lookups as the inverted index, so that only the file records a query
+// reaches have to be parsed in full.  Lookups go through the hash buckets,
+// so they take time in the number of records naming the function, whatever
+// the size of the database.
+class CSPrescan {
+   public:
+    // Scan the symbols in [start, end) of 'data', using 'jobs' threads.  Only
+    // the mark lines are looked at, with skipScanSymbols(), however the
+    // records a query reaches are parsed afterwards.
+    void scan(const uint8_t* data,
+              size_t start,
+              size_t end,
+              size_t data_len,
+              unsigned jobs,
+              bool compressed);
+
+    // The first definition of 'term', and a place in each file record that
+    // may call it
+    std::vector<CSPosting> find(std::string_view term) const;
+
+    // A definition, at the offset of its name
+    struct Def {
+        uint32_t hash;
+        size_t offset;
+    };
+
+    // A name called by a file record
+    struct Call {
+        uint32_t hash;
+        uint32_t record;  // Index in _records
+    };
+
+   private:
+    const uint8_t* _data = nullptr;
+    size_t _data_len = 0;
+    bool _compressed = false;
+    std::vector<size_t> _records;  // Offsets of the file paths
+    CSHashBuckets<Def> _defs;      // In database order
+    CSHashBuckets<Call> _calls;    // In record order
+};
+
+// How a database is read
+enum CSBackend {
+    CS_MMAP,   // Map the file, with hints for how it will be accessed
+    CS_PREAD,  // Large preads, reading the next block while one is parsed
+    CS_URING,  // Several block reads kept queued through io_uring
+    CS_BACKEND_COUNT
+};
+static constexpr const char* cs_backend_names[CS_BACKEND_COUNT] = {
+    "mmap", "pread", "uring"};
+
+// Where a CSStream reads from.  Sources own the file they read.
+class CSSource {
+   public:
+    virtual ~CSSource() = default;
+
+    // Read up to 'len' bytes into 'dst'.  Returns 0 at the end of input.  A
+    // read error ends the program, as part of a database would be missing.
+    virtual size_t read(uint8_t* dst, size_t len) = 0;
+};
+
+// Reads with stdio, which works on pipes
+class CSFileSource : public CSSource {
+   public:
+    explicit CSFileSource(FILE* fp) : _fp(fp) {}
+    ~CSFileSource() { fclose(_fp); }
+    size_t read(uint8_t* dst, size_t len) override;
+
+   private:
+    FILE* _fp;
+};
+
+// Reads a file of 'size' bytes with large preads into two blocks: the next
+// block is read in the background while the current one is consumed.
+class CSPreadSource : public CSSource {
+   public:
+    CSPreadSource(FILE* fp, size_t size);
+    ~CSPreadSource();
+    size_t read(uint8_t* dst, size_t len) override;
+
+   private:
+    static constexpr size_t block_size = 4 * 1024 * 1024;
+    FILE* _fp;
+    size_t _size;
+    std::unique_ptr<uint8_t[]> _blocks[2];
+    std::future<ssize_t> _next;  // The read of the other block
+    size_t _next_off = 0;        // Where the next block starts
+    int _cur = 1;                // The block being consumed
+    size_t _pos = 0;             // Bytes of it consumed
+    size_t _len = 0;             // Bytes of it read
+
+    void readAhead();
+};
+
+#ifdef CS_HAVE_URING
+// Reads a file of 'size' bytes through io_uring, keeping reads of the next
+// few blocks queued while the current one is consumed
+class CSUringSource : public CSSource {
+   public:
+    // Returns null when io_uring can not be set up, e.g. in a sandbox, or
+    // can not read files, before Linux 5.6
+    static std::unique_ptr<CSUringSource> open(FILE* fp, size_t size);
+    ~CSUringSource();
+    size_t read(uint8_t* dst, size_t len) override;
+
+   private:
+    static constexpr unsigned depth = 8;
+    static constexpr size_t block_size = 1024 * 1024;
+
+    struct Block {
+        std::unique_ptr<uint8_t[]> buf;
+        size_t off = 0;
+        size_t len = 0;  // Zero when there is nothing left to read
+        ssize_t result = 0;
+        bool done = false;
+    };
+
+    FILE* _fp;
+    size_t _size;
+    int _ring = -1;
+    void* _sq_ring = MAP_FAILED;
+    size_t _sq_ring_len = 0;
+    void* _cq_ring = MAP_FAILED;
+    size_t _cq_ring_len = 0;
+    io_uring_sqe* _sqes = (io_uring_sqe*)MAP_FAILED;
+    size_t _sqes_len = 0;
+    unsigned *_sq_tail, *_sq_mask, *_sq_array;
+    unsigned *_cq_head, *_cq_tail, *_cq_mask;
+    io_uring_cqe* _cqes;
+
+    Block _blocks[depth];
+    unsigned _cur = 0;  // The block being consumed, blocks are used in turn
+    size_t _pos = 0;    // Bytes of it consumed
+    size_t _next_off = 0;
+    unsigned _in_flight = 0;
+
+    CSUringSource(FILE* fp, size_t size) : _fp(fp), _size(size) {}
+    bool setup();
+    void submit(unsigned i);
+    bool reap(bool wait);
+};
+#endif
+
+// Reads a database that is not mapped, such as a pipe, through a buffer of
+// bounded size.  Only whole lines are handed out.  Consumed bytes are dropped
+// from the front and the unfinished last line moves down to make room, so the
+// buffer only grows when a single line does not fit.
+class CSStream {
+   public:
+    explicit CSStream(std::unique_ptr<CSSource> source);
+    CSStream(const CSStream&) = delete;
+    CSStream& operator=(const CSStream&) = delete;
+
+    // Fill the buffer and return the whole lines at its front, plus the last
+    // line at the end of input.  Empty once everything has been consumed.
+    std::string_view lines();
+
+    // Drop the first 'n' bytes of the buffer
+    void consume(size_t n);
+
+    // Database offset of the first buffered byte
+    size_t offset() const { return _offset; }
+
+   private:
+    static constexpr size_t initial_size = 1024 * 1024;
+    std::unique_ptr<CSSource> _source;
+    std::unique_ptr<uint8_t[]> _buf;
+    size_t _size;
+    size_t _len = 0;
+    size_t _offset = 0;
+    bool _eof = false;
+};
+
+// Options controlling how a cscope database is loaded
+struct CSOptions {
+    unsigned jobs = 1;         // Threads used to parse and to traverse
+    bool keep_mapped = false;  // Reference symbol names inside the database
+    bool use_index = false;    // Answer queries through the inverted index
+    bool lazy = false;         // Only parse the file records a query reaches
+    CSBackend backend = CS_MMAP;
+    bool skip_scan = false;  // Only look at function and file mark lines
+};
+
+// A depth with no limit: the full closure
+static constexpr int cs_unbounded = std::numeric_limits<int>::max();
+
+// A call graph query about one function
+struct CSQuery {
+    std::string_view fn_name;
+    int depth;
+    bool callers;
+    bool callees;
+};
+
 // cscope database, contains a list of file entries
 struct CS {
    public:
-    CS(FILE* fp);
-    std::vector<CSFile*> files;
-    CSDB* db;
+    CS(FILE* fp, const char* name, const CSOptions& opts);
+    CS(const CS&) = delete;
+    CS& operator=(const CS&) = delete;
+    ~CS();
+    std::vector<CSFile> files;
+    std::vector<CSSym> syms;
+    CSInterner symbols;
+    CSGraph graph;
+
+    // Load the symbols needed to answer 'query' and build 'graph'
+    void load(const CSQuery& query);
+
+    // Queries on what load() built.  They never change the CS, so once it is
+    // loaded any number of them may run at once, from any threads.
+
+    // The ID of the function 'fn_name', or cs_no_name if the graph lacks it
+    CSNameId findFunction(std::string_view fn_name) const;
+
+    // The IDs of the functions 'pattern' names, in ID order: those defined
+    // in the database that start with what comes before its trailing '*',
+    // or else the one findFunction() finds.  Pattern queries need all of
+    // the database loaded.
+    std::vector<CSNameId> findFunctions(std::string_view pattern) const;
+
+    // The IDs of the functions defined in the database that 're' matches,
+    // in ID order
+    std::vector<CSNameId> findMatching(const CSRegex& re) const;
+
+    // The edges within 'depth' calls of 'fn', in dot syntax.  With
+    // cs_unbounded, each cycle reached is drawn once, as a cluster of its
+    // functions in place of the calls inside it.  The traversal is the same
+    // BFS over the call graph either way, the cycles only change what is
+    // drawn.  Large traversals use 'jobs' threads, or as many as the CS was
+    // loaded with.
+    std::string getCallers(CSNameId fn, int depth, unsigned jobs = 0) const;
+    std::string getCallees(CSNameId fn, int depth, unsigned jobs = 0) const;
+
+    // The same for all of the functions 'fns' at once, each edge once
+    std::string getCallers(std::span<const CSNameId> fns,
+                           int depth,
+                           unsigned jobs = 0) const;
+    std::string getCallees(std::span<const CSNameId> fns,
+                           int depth,
+                           unsigned jobs = 0) const;
+
+    // The calls on the shortest call chains from 'from' to 'to', in dot
+    // syntax
+    std::string getPaths(CSNameId from, CSNameId to) const;
+
+    // Up to 'count' call chains from 'from' to 'to' that repeat no function
+    // and make at most 'length' calls, one per line in dot syntax: the
+    // shortest ones, or with 'all' every one, depth first
+    std::string getChains(CSNameId from,
+                          CSNameId to,
+                          size_t count,
+                          uint32_t length,
+                          bool all) const;
 
    private:
     CSHeader _hdr;
     CSTrailer _trailer;
     const char* _name;
     int _n_functions;
+    CSOptions _opts;
+
+    // The mapped database, kept while symbol names point into it
+    uint8_t* _data;
+    size_t _data_len;
+
+    // The database when it is not mapped
+    std::unique_ptr<CSStream> _stream;
+
+    // How the database was read, and since when
+    const char* _backend;
+    std::chrono::steady_clock::time_point _start;
+
+    // Database entries of the names, while loading
+    CSDB _db;
+
+    // Copied symbol names, one pool per parsed chunk
+    std::vector<CSStringPool> _pools;
+
+    // Cycles of 'graph', found by the first unbounded query to draw them
+    mutable std::once_flag _components_once;
+    mutable CSComponents _components;
+
+    // Sorted names of the defined functions, built by the first pattern
+    // query
+    mutable std::once_flag _names_once;
+    mutable CSNameIndex _names;
+
+    // Traversals of 'graph' that finished their query, for the next ones
+    mutable std::mutex _traversals_mutex;
+    mutable std::vector<std::unique_ptr<CSTraversal>> _traversals;
+
+    const CSComponents& components() const;
+    const CSNameIndex& names() const;
+    std::unique_ptr<CSTraversal> takeTraversal() const;
+    void keepTraversal(std::unique_ptr<CSTraversal> traversal) const;
+    std::string getEdges(std::span<const CSNameId> fns,
+                         int depth,
+                         CSDirection dir,
+                         unsigned jobs) const;
 
     void initHeader(const uint8_t* data, size_t data_size);
     void initTrailer(const uint8_t* data, size_t data_size);
     void initSymbols(const uint8_t* data, size_t data_size);
+    void streamSymbols();
+    bool loadIndexed(const CSQuery& query);
+    bool loadLazy(const CSQuery& query);
+    template <typename Index>
+    void loadRecords(const Index& index, const CSQuery& query);
     void loadCScope();
 };
 
-#define CS_FN_DEF '$'
-#define CS_FN_CALL '`'
-static const char cs_marks[] = {'@', CS_FN_DEF, CS_FN_CALL, '}', '#', ')',
-                                '~', '=',       ';',        'c', 'e', 'g',
-                                'l', 'm',       'p',        's', 't', 'u'};
+static constexpr char cs_marks[] = {'@', CS_FN_DEF, CS_FN_CALL, '}', '#', ')',
+                                    '~', '=',       ';',        'c', 'e', 'g',
+                                    'l', 'm',       'p',        's', 't', 'u'};
 
 typedef struct {
     size_t off;
@@ -219,42 +965,874 @@ typedef struct {
 #define DBG(...)
 #endif
 
+// Lookup table of the <mark> characters a scan accepts
+typedef std::array<bool, 256> CSMarkTable;
+
+static constexpr CSMarkTable makeMarkTable(std::string_view marks) {
+    CSMarkTable table = {};
+    for (char c : marks)
+        table[(uint8_t)c] = true;
+    return table;
+}
+
+static constexpr CSMarkTable all_marks =
+    makeMarkTable(std::string_view(cs_marks, sizeof(cs_marks)));
+static constexpr CSMarkTable file_marks = makeMarkTable("@");
+
+// Scanning kernels over the database.  Each returns 'end' when nothing is
+// found.  The vector versions handle whole blocks and leave the tail to the
+// scalar ones.
+struct CSScanKernels {
+    const char* name;
+
+    // First '\n' in [p, end)
+    const uint8_t* (*findNewline)(const uint8_t* p, const uint8_t* end);
+
+    // First '\t' in [p, end) that is followed by a mark from 'marks'
+    const uint8_t* (*findMark)(const uint8_t* p,
+                               const uint8_t* end,
+                               const CSMarkTable& marks);
+};
+
+static const uint8_t* findNewlineScalar(const uint8_t* p,
+                                        const uint8_t* end) {
+    auto nl = (const uint8_t*)memchr(p, '\n', end - p);
+    return nl ? nl : end;
+}
+
+static const uint8_t* findMarkScalar(const uint8_t* p,
+                                     const uint8_t* end,
+                                     const CSMarkTable& marks) {
+    for (; p + 1 < end; ++p)
+        if (*p == '\t' && marks[p[1]])
+            return p;
+    return end;
+}
+
+// Check every tab flagged in 'tabs' (bit i set for a tab at p[i]) for a mark
+static const uint8_t* checkTabs(const uint8_t* p,
+                                unsigned tabs,
+                                const uint8_t* end,
+                                const CSMarkTable& marks) {
+    for (; tabs; tabs &= tabs - 1) {
+        const uint8_t* tab = p + __builtin_ctz(tabs);
+        if (tab + 1 < end && marks[tab[1]])
+            return tab;
+    }
+    return nullptr;
+}
+
+#ifdef CS_X86_KERNELS
+__attribute__((target("sse2"))) static const uint8_t* findNewlineSSE2(
+    const uint8_t* p,
+    const uint8_t* end) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; end - p >= 16; p += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)p);
+        unsigned hits = _mm_movemask_epi8(_mm_cmpeq_epi8(block, nl));
+        if (hits)
+            return p + __builtin_ctz(hits);
+    }
+    return findNewlineScalar(p, end);
+}
+
+__attribute__((target("sse2"))) static const uint8_t* findMarkSSE2(
+    const uint8_t* p,
+    const uint8_t* end,
+    const CSMarkTable& marks) {
+    const __m128i tab = _mm_set1_epi8('\t');
+    for (; end - p >= 16; p += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)p);
+        unsigned tabs = _mm_movemask_epi8(_mm_cmpeq_epi8(block, tab));
+        if (const uint8_t* hit = checkTabs(p, tabs, end, marks))
+            return hit;
+    }
+    return findMarkScalar(p, end, marks);
+}
+
+__attribute__((target("avx2"))) static const uint8_t* findNewlineAVX2(
+    const uint8_t* p,
+    const uint8_t* end) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    for (; end - p >= 32; p += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)p);
+        unsigned hits = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, nl));
+        if (hits)
+            return p + __builtin_ctz(hits);
+    }
+    return findNewlineScalar(p, end);
+}
+
+__attribute__((target("avx2"))) static const uint8_t* findMarkAVX2(
+    const uint8_t* p,
+    const uint8_t* end,
+    const CSMarkTable& marks) {
+    const __m256i tab = _mm256_set1_epi8('\t');
+    for (; end - p >= 32; p += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)p);
+        unsigned tabs = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, tab));
+        if (const uint8_t* hit = checkTabs(p, tabs, end, marks))
+            return hit;
+    }
+    return findMarkScalar(p, end, marks);
+}
+#endif
+
+// Every kernel set this CPU can run, fastest last
+static std::vector<CSScanKernels> availableScanKernels() {
+    std::vector<CSScanKernels> kernels = {
+        {"scalar", findNewlineScalar, findMarkScalar}};
+#ifdef CS_X86_KERNELS
+    if (__builtin_cpu_supports("sse2"))
+        kernels.push_back({"sse2", findNewlineSSE2, findMarkSSE2});
+    if (__builtin_cpu_supports("avx2"))
+        kernels.push_back({"avx2", findNewlineAVX2, findMarkAVX2});
+#endif
+    return kernels;
+}
+
+// The kernels used by the parser, picked once at startup
+static const CSScanKernels scan = availableScanKernels().back();
+
 static void getLine(pos_t* pos, char* buf, size_t buf_len) {
     size_t len, st = pos->off;
 
     // Get initial line (header line)
-    while (CH(pos) != EOF && CH(pos) != '\n')
+    while (!END(pos) && CH(pos) != '\n')
         ++pos->off;
 
     len = pos->off - st;  // Don't return the '\n'
     ++pos->off;           // +1 to advance to the '\n'
-    if (END(pos) || len > buf_len)
+    if (len >= buf_len)
         return;
 
     memcpy(buf, pos->data + st, len);
     buf[len] = '\0';
 }
 
-static CSFile* newFile(const char* str) {
-    const char* c = str;
+// Compressed databases pack common character pairs into a single byte with
+// the high bit set: 0x80 + 8 * <index in dichar1> + <index in dichar2>.
+// Keywords in <non-symbol text> are packed into bytes below ' ' as well, but
+// the parser never looks inside that text.
+static constexpr char dichar1[] = " teisaprnl(of)=c";
+static constexpr char dichar2[] = " tnerpla";
+
+// The two characters each compressed byte expands to, indexed by byte - 0x80
+static constexpr auto digraphs = [] {
+    std::array<std::array<char, 2>, 128> table = {};
+    for (size_t i = 0; i < table.size(); ++i)
+        table[i] = {dichar1[i / 8], dichar2[i % 8]};
+    return table;
+}();
+
+static size_t countDigraphs(std::string_view name) {
+    size_t n = 0;
+    for (char c : name)
+        n += (uint8_t)c >> 7;
+    return n;
+}
 
-    // Skip whitespace
-    while (isspace(*c))
-        ++c;
+// Run 'fn(i)' for every i in [0, n) on a pool of up to 'jobs' threads. Workers
+// pull indices off a shared counter, so uneven work items balance out.
+template <typename F>
+static void parallelFor(size_t n, unsigned jobs, F fn) {
+    std::atomic<size_t> next = 0;
+    auto worker = [&]() {
+        for (size_t i; (i = next++) < n;)
+            fn(i);
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < jobs && i < n; i++)
+        pool.emplace_back(worker);
+    worker();
+    for (auto& t : pool)
+        t.join();
+}
 
-    return new CSFile(c + 1, *c);
+template <typename Part, typename Visit, typename Join>
+void CSTraversal::run(std::span<const CSNameId> fns,
+                      int depth,
+                      CSDirection dir,
+                      unsigned jobs,
+                      Visit visit,
+                      Join join) {
+    std::vector<Part> parts;
+    _frontier.assign(fns.begin(), fns.end());
+    _reached.assign(fns.begin(), fns.end());
+    for (CSNameId fn : fns)
+        claim(fn);
+    for (; depth > 0 && !_frontier.empty(); --depth) {
+        size_t n_blocks = (_frontier.size() + block_size - 1) / block_size;
+        if (_found.size() < n_blocks)
+            _found.resize(n_blocks);
+        if (parts.size() < n_blocks)
+            parts.resize(n_blocks);
+        parallelFor(n_blocks, jobs, [&](size_t b) {
+            size_t end = std::min(_frontier.size(), (b + 1) * block_size);
+            for (size_t i = b * block_size; i < end; ++i) {
+                CSNameId id = _frontier[i];
+                for (CSNameId next : _graph.next(dir, id)) {
+                    visit(parts[b], id, next);
+                    if (claim(next))
+                        _found[b].push_back(next);
+                }
+            }
+        });
+
+        // Blocks are joined in order, which threads claimed what does not
+        // matter once the next level is sorted
+        _frontier.clear();
+        for (size_t b = 0; b < n_blocks; ++b) {
+            join(parts[b]);
+            parts[b] = Part();
+            _frontier.insert(_frontier.end(), _found[b].begin(),
+                             _found[b].end());
+            _found[b].clear();
+        }
+        std::sort(_frontier.begin(), _frontier.end());
+        _reached.insert(_reached.end(), _frontier.begin(), _frontier.end());
+    }
+
+    // Only what was reached needs clearing for the next run
+    for (CSNameId id : _reached)
+        _seen[id / 64].store(0, std::memory_order_relaxed);
 }
 
-static bool isMark(char c) {
-    unsigned i;
-    for (i = 0; i < sizeof(cs_marks) / sizeof(cs_marks[0]); ++i)
-        if (c == cs_marks[i])
-            return true;
+CSComponents::CSComponents(const CSGraph& graph) {
+    static constexpr uint32_t unvisited = UINT32_MAX;
+    std::vector<uint32_t> index(graph.size(), unvisited), low(graph.size());
+    std::vector<bool> on_stack(graph.size());
+    std::vector<CSNameId> stack;
+    std::vector<std::pair<CSNameId, uint32_t>> calls;  // Function, next edge
+    uint32_t n_visited = 0;
+
+    _component.resize(graph.size());
+    _offsets.push_back(0);
+    for (CSNameId root = 0; root < graph.size(); ++root) {
+        if (index[root] != unvisited)
+            continue;
+        calls.emplace_back(root, 0);
+        index[root] = low[root] = n_visited++;
+        stack.push_back(root);
+        on_stack[root] = true;
+
+        while (!calls.empty()) {
+            CSNameId id = calls.back().first;
+            std::span<const CSNameId> callees = graph.callees(id);
+            if (calls.back().second < callees.size()) {
+                CSNameId callee = callees[calls.back().second++];
+                if (index[callee] == unvisited) {
+                    index[callee] = low[callee] = n_visited++;
+                    stack.push_back(callee);
+                    on_stack[callee] = true;
+                    calls.emplace_back(callee, 0);
+                } else if (on_stack[callee]) {
+                    low[id] = std::min(low[id], index[callee]);
+                }
+                continue;
+            }
+
+            // Done with 'id', it may close a component
+            calls.pop_back();
+            if (!calls.empty()) {
+                CSNameId caller = calls.back().first;
+                low[caller] = std::min(low[caller], low[id]);
+            }
+            if (low[id] != index[id])
+                continue;
+            size_t first = _members.size();
+            CSNameId member;
+            do {
+                member = stack.back();
+                stack.pop_back();
+                on_stack[member] = false;
+                _component[member] = _offsets.size() - 1;
+                _members.push_back(member);
+            } while (member != id);
+            std::sort(_members.begin() + first, _members.end());
+            _offsets.push_back(_members.size());
+        }
+    }
+}
+
+std::vector<std::vector<CSNameId>> CSPaths::shortest(CSNameId from,
+                                                     CSNameId to) {
+    if (from == to)
+        return {{from}};
+
+    // Distances from 'from' and to 'to', as far as each side has looked
+    static constexpr uint32_t far = UINT32_MAX;
+    std::vector<uint32_t> dist_from(_graph.size(), far);
+    std::vector<uint32_t> dist_to(_graph.size(), far);
+    std::vector<CSNameId> frontier_from = {from}, frontier_to = {to}, next;
+    std::vector<CSNameId> meet;
+    uint32_t depth_from = 0, depth_to = 0;
+    dist_from[from] = 0;
+    dist_to[to] = 0;
+    while (meet.empty() && !frontier_from.empty() && !frontier_to.empty()) {
+        bool forward = frontier_from.size() <= frontier_to.size();
+        std::vector<CSNameId>& frontier = forward ? frontier_from : frontier_to;
+        std::vector<uint32_t>& dist = forward ? dist_from : dist_to;
+        std::vector<uint32_t>& other = forward ? dist_to : dist_from;
+        uint32_t level = forward ? ++depth_from : ++depth_to;
+
+        next.clear();
+        for (CSNameId id : frontier) {
+            for (CSNameId n : _graph.next(forward ? CS_CALLEES : CS_CALLERS,
+                                          id)) {
+                if (dist[n] != far)
+                    continue;
+                dist[n] = level;
+                next.push_back(n);
+                if (other[n] != far)
+                    meet.push_back(n);
+            }
+        }
+        frontier.swap(next);
+    }
+    if (meet.empty())
+        return {};
+
+    // The sides first meet where both have looked as far as they can without
+    // overlapping, so every shortest chain crosses the meeting level
+    uint32_t length = depth_from + depth_to;
+    std::vector<std::vector<CSNameId>> levels(length + 1);
+    std::vector<bool> on_chain(_graph.size());
+    auto add = [&](std::vector<CSNameId>& level, CSNameId id) {
+        if (!on_chain[id]) {
+            on_chain[id] = true;
+            level.push_back(id);
+        }
+    };
+    for (CSNameId id : meet)
+        add(levels[depth_from], id);
+    std::sort(levels[depth_from].begin(), levels[depth_from].end());
+    for (uint32_t i = depth_from; i > 0; --i) {
+        for (CSNameId id : levels[i])
+            for (CSNameId caller : _graph.callers(id))
+                if (dist_from[caller] == i - 1)
+                    add(levels[i - 1], caller);
+        std::sort(levels[i - 1].begin(), levels[i - 1].end());
+    }
+    for (uint32_t i = depth_from; i < length; ++i) {
+        for (CSNameId id : levels[i])
+            for (CSNameId callee : _graph.callees(id))
+                if (dist_to[callee] == length - i - 1)
+                    add(levels[i + 1], callee);
+        std::sort(levels[i + 1].begin(), levels[i + 1].end());
+    }
+    return levels;
+}
+
+bool CSPaths::shortestChain(CSNameId from,
+                            CSNameId to,
+                            uint32_t length,
+                            std::span<const CSNameId> banned,
+                            std::span<const CSNameId> banned_next,
+                            Chain& chain) {
+    if (_mark.empty()) {
+        _mark.assign(_graph.size(), 0);
+        _parent.resize(_graph.size());
+    }
+    ++_round;
+    for (CSNameId id : banned)
+        _mark[id] = _round;
+    _mark[from] = _round;
+
+    std::vector<CSNameId> frontier = {from}, next;
+    for (uint32_t level = 0; level < length && !frontier.empty(); ++level) {
+        next.clear();
+        for (CSNameId id : frontier) {
+            _callees.assign(_graph.callees(id).begin(),
+                            _graph.callees(id).end());
+            std::sort(_callees.begin(), _callees.end());
+            for (CSNameId callee : _callees) {
+                if (_mark[callee] == _round ||
+                    (id == from &&
+                     std::find(banned_next.begin(), banned_next.end(),
+                               callee) != banned_next.end()))
+                    continue;
+                _mark[callee] = _round;
+                _parent[callee] = id;
+                if (callee == to) {
+                    chain.clear();
+                    for (CSNameId n = to; n != from; n = _parent[n])
+                        chain.push_back(n);
+                    chain.push_back(from);
+                    std::reverse(chain.begin(), chain.end());
+                    return true;
+                }
+                next.push_back(callee);
+            }
+        }
+        frontier.swap(next);
+    }
     return false;
 }
 
-// Parse each line in the <file mark><file path>:
-// From docs:
+std::vector<CSPaths::Chain> CSPaths::kShortest(CSNameId from,
+                                                CSNameId to,
+                                                size_t count,
+                                                uint32_t length) {
+    std::vector<Chain> found;
+    Chain chain;
+    if (from == to || count == 0 ||
+        !shortestChain(from, to, length, {}, {}, chain))
+        return found;
+    found.push_back(chain);
+
+    // Candidates by number of calls, then by IDs
+    std::set<std::pair<size_t, Chain>> candidates;
+    std::vector<CSNameId> banned_next;
+    while (found.size() < count) {
+        // Branch off every function but the last of the latest chain, with
+        // the calls the chains found so far make from there taken away
+        const Chain last = found.back();
+        for (size_t i = 0; i + 1 < last.size(); ++i) {
+            banned_next.clear();
+            for (const Chain& c : found)
+                if (c.size() > i + 1 &&
+                    std::equal(last.begin(), last.begin() + i + 1, c.begin()))
+                    banned_next.push_back(c[i + 1]);
+
+            std::span<const CSNameId> root(last.data(), i);
+            if (!shortestChain(last[i], to, length - i, root, banned_next,
+                               chain))
+                continue;
+            Chain candidate(last.begin(), last.begin() + i);
+            candidate.insert(candidate.end(), chain.begin(), chain.end());
+            candidates.emplace(candidate.size(), std::move(candidate));
+        }
+        if (candidates.empty())
+            break;
+        found.push_back(std::move(candidates.begin()->second));
+        candidates.erase(candidates.begin());
+    }
+    return found;
+}
+
+std::vector<CSPaths::Chain> CSPaths::simple(CSNameId from,
+                                             CSNameId to,
+                                             size_t count,
+                                             uint32_t length) {
+    std::vector<Chain> found;
+    if (from == to || count == 0)
+        return found;
+
+    // Calls each function needs at least to reach 'to', within 'length'
+    static constexpr uint32_t far = UINT32_MAX;
+    std::vector<uint32_t> dist(_graph.size(), far);
+    std::vector<CSNameId> frontier = {to}, next;
+    dist[to] = 0;
+    for (uint32_t level = 1; level <= length && !frontier.empty(); ++level) {
+        next.clear();
+        for (CSNameId id : frontier)
+            for (CSNameId caller : _graph.callers(id))
+                if (dist[caller] == far) {
+                    dist[caller] = level;
+                    next.push_back(caller);
+                }
+        frontier.swap(next);
+    }
+    if (dist[from] == far)
+        return found;
+
+    // The chain so far, with the next call to try from each of its functions
+    Chain chain = {from};
+    std::vector<size_t> next_call = {0};
+    std::vector<bool> on_chain(_graph.size());
+    on_chain[from] = true;
+    while (!chain.empty() && found.size() < count) {
+        std::span<const CSNameId> callees = _graph.callees(chain.back());
+        if (next_call.back() == callees.size()) {
+            on_chain[chain.back()] = false;
+            chain.pop_back();
+            next_call.pop_back();
+            continue;
+        }
+        CSNameId callee = callees[next_call.back()++];
+        uint32_t left = length - chain.size();
+        if (callee == to) {
+            found.push_back(chain);
+            found.back().push_back(to);
+        } else if (!on_chain[callee] && dist[callee] <= left) {
+            chain.push_back(callee);
+            next_call.push_back(0);
+            on_chain[callee] = true;
+        }
+    }
+    return found;
+}
+
+// Thompson NFA built while parsing a CSRegex.  A state either moves on the
+// bytes in 'bytes' to 'next', or on nothing to each of 'eps'.
+struct CSRegexParser {
+    struct State {
+        std::bitset<256> bytes;
+        uint32_t next = UINT32_MAX;
+        std::vector<uint32_t> eps;
+    };
+
+    // Part of the NFA, entered at 'in' and left from 'out', which has no
+    // moves yet
+    struct Frag {
+        uint32_t in;
+        uint32_t out;
+    };
+
+    std::string_view re;
+    size_t pos = 0;
+    std::vector<State> states;
+    std::string error;
+
+    bool more() const { return pos < re.size() && error.empty(); }
+
+    uint32_t add() {
+        states.emplace_back();
+        return states.size() - 1;
+    }
+
+    void link(uint32_t from, uint32_t to) { states[from].eps.push_back(to); }
+
+    Frag bytes(const std::bitset<256>& set) {
+        uint32_t in = add(), out = add();
+        states[in].bytes = set;
+        states[in].next = out;
+        return {in, out};
+    }
+
+    Frag alternation() {
+        Frag f = concatenation();
+        while (more() && re[pos] == '|') {
+            ++pos;
+            Frag g = concatenation();
+            uint32_t in = add(), out = add();
+            link(in, f.in);
+            link(in, g.in);
+            link(f.out, out);
+            link(g.out, out);
+            f = {in, out};
+        }
+        return f;
+    }
+
+    Frag concatenation() {
+        uint32_t in = add();
+        Frag f = {in, in};
+        while (more() && re[pos] != '|' && re[pos] != ')') {
+            Frag g = repetition();
+            link(f.out, g.in);
+            f.out = g.out;
+        }
+        return f;
+    }
+
+    Frag repetition() {
+        Frag f = atom();
+        while (more() && (re[pos] == '*' || re[pos] == '+' || re[pos] == '?')) {
+            char op = re[pos++];
+            uint32_t in = add(), out = add();
+            link(in, f.in);
+            if (op != '+')
+                link(in, out);
+            link(f.out, out);
+            if (op != '?')
+                link(f.out, f.in);
+            f = {in, out};
+        }
+        return f;
+    }
+
+    Frag atom() {
+        std::bitset<256> set;
+        char c = re[pos++];
+        if (c == '(') {
+            Frag f = alternation();
+            if (more() && re[pos] == ')')
+                ++pos;
+            else if (error.empty())
+                error = "unmatched (";
+            return f;
+        }
+        if (c == '[')
+            set = bracket();
+        else if (c == '.')
+            set.set();
+        else if (c == '\\' && pos < re.size())
+            set.set((uint8_t)re[pos++]);
+        else if (c == '*' || c == '+' || c == '?' || c == '^' || c == '$')
+            error = std::format("unexpected {}", c);
+        else
+            set.set((uint8_t)c);
+        return bytes(set);
+    }
+
+    // The bytes of a bracket expression, after its '['
+    std::bitset<256> bracket() {
+        std::bitset<256> set;
+        bool negate = pos < re.size() && re[pos] == '^';
+        if (negate)
+            ++pos;
+        for (bool first = true; pos < re.size() && (first || re[pos] != ']');
+             first = false) {
+            uint8_t lo = re[pos++], hi = lo;
+            if (pos + 1 < re.size() && re[pos] == '-' && re[pos + 1] != ']') {
+                hi = re[pos + 1];
+                pos += 2;
+            }
+            for (unsigned b = lo; b <= hi; ++b)
+                set.set(b);
+        }
+        if (pos < re.size())
+            ++pos;
+        else
+            error = "unmatched [";
+        return negate ? ~set : set;
+    }
+};
+
+bool CSRegex::compile(std::string_view pattern, std::string& error) {
+    bool anchor_start = pattern.starts_with('^');
+    if (anchor_start)
+        pattern.remove_prefix(1);
+    bool anchor_end = pattern.ends_with('$') && !pattern.ends_with("\\$");
+    if (anchor_end)
+        pattern.remove_suffix(1);
+
+    CSRegexParser parser{pattern};
+    CSRegexParser::Frag frag = parser.alternation();
+    if (parser.more())
+        parser.error = "unmatched )";
+    if (!parser.error.empty()) {
+        error = parser.error;
+        return false;
+    }
+    const std::vector<CSRegexParser::State>& nfa = parser.states;
+
+    // Bytes that are in the same sets of every state behave the same
+    std::map<std::vector<bool>, uint8_t> class_of;
+    std::vector<uint8_t> example;
+    for (unsigned b = 0; b < 256; ++b) {
+        std::vector<bool> in_sets;
+        for (const CSRegexParser::State& state : nfa)
+            if (state.next != UINT32_MAX)
+                in_sets.push_back(state.bytes[b]);
+        auto [it, added] = class_of.emplace(in_sets, class_of.size());
+        if (added)
+            example.push_back(b);
+        this->_classes[b] = it->second;
+    }
+    this->_n_classes = class_of.size();
+
+    // The NFA states reachable from 'set' without moving, in order
+    std::vector<uint32_t> stamp(nfa.size(), 0);
+    uint32_t round = 0;
+    auto close = [&](std::vector<uint32_t> set) {
+        ++round;
+        for (uint32_t q : set)
+            stamp[q] = round;
+        for (size_t i = 0; i < set.size(); ++i) {
+            for (uint32_t q : nfa[set[i]].eps) {
+                if (stamp[q] != round) {
+                    stamp[q] = round;
+                    set.push_back(q);
+                }
+            }
+        }
+        std::sort(set.begin(), set.end());
+        return set;
+    };
+
+    // Subset construction, DFA state 0 being the empty set.  Without '^' the
+    // NFA is entered again at every byte, and without '$' a match stays one
+    // whatever follows.
+    std::map<std::vector<uint32_t>, uint32_t> dfa_of;
+    std::vector<std::vector<uint32_t>> sets;
+    auto dfaState = [&](std::vector<uint32_t> set) {
+        auto [it, added] = dfa_of.emplace(set, sets.size());
+        if (added)
+            sets.push_back(std::move(set));
+        return it->second;
+    };
+    dfaState({});
+    this->_start = dfaState(close({frag.in}));
+    this->_table.clear();
+    this->_accepting.clear();
+    for (uint32_t d = 0; d < sets.size(); ++d) {
+        if (sets.size() > max_states) {
+            error = "too many states";
+            return false;
+        }
+        std::vector<uint32_t> set = sets[d];
+        bool accepting = std::binary_search(set.begin(), set.end(), frag.out);
+        this->_accepting.push_back(accepting);
+        for (size_t k = 0; k < this->_n_classes; ++k) {
+            if (accepting && !anchor_end) {
+                this->_table.push_back(d);
+                continue;
+            }
+            std::vector<uint32_t> next;
+            if (!anchor_start)
+                next.push_back(frag.in);
+            for (uint32_t q : set)
+                if (nfa[q].next != UINT32_MAX && nfa[q].bytes[example[k]])
+                    next.push_back(nfa[q].next);
+            this->_table.push_back(dfaState(close(std::move(next))));
+        }
+    }
+    return true;
+}
+
+CSNameIndex::CSNameIndex(const CSInterner& symbols,
+                         std::span<const CSNameId> ids,
+                         unsigned jobs) {
+    // Sort on the first 8 bytes of each name, kept beside it, so that most
+    // comparisons never touch the names
+    struct Entry {
+        uint64_t key;
+        std::string_view name;
+        CSNameId id;
+    };
+    std::vector<Entry> sorted;
+    sorted.reserve(ids.size());
+    for (CSNameId id : ids) {
+        std::string_view name = symbols.name(id);
+        uint64_t key = 0;
+        for (size_t i = 0; i < 8; ++i)
+            key = key << 8 | (i < name.size() ? (uint8_t)name[i] : 0);
+        sorted.push_back({key, name, id});
+    }
+    auto less = [](const Entry& a, const Entry& b) {
+        return a.key != b.key ? a.key < b.key : a.name < b.name;
+    };
+
+    // Sort a run per thread, then merge the runs in pairs
+    size_t run = (sorted.size() + jobs - 1) / jobs;
+    size_t n_runs = run ? (sorted.size() + run - 1) / run : 0;
+    auto bound = [&](size_t r) {
+        return sorted.begin() + std::min(sorted.size(), r * run);
+    };
+    parallelFor(n_runs, jobs, [&](size_t r) {
+        std::sort(bound(r), bound(r + 1), less);
+    });
+    for (size_t width = 1; width < n_runs; width *= 2) {
+        parallelFor((n_runs + 2 * width - 1) / (2 * width), jobs,
+                    [&](size_t m) {
+                        size_t r = m * 2 * width;
+                        std::inplace_merge(bound(r), bound(r + width),
+                                           bound(r + 2 * width), less);
+                    });
+    }
+
+    std::string_view prev;
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        auto [key, name, id] = sorted[i];
+        this->_ids.push_back(id);
+        size_t shared = 0;
+        if (i % bucket_size == 0)
+            this->_buckets.push_back(this->_bytes.size());
+        else
+            while (shared < std::min(prev.size(), name.size()) &&
+                   prev[shared] == name[shared])
+                ++shared;
+        putLength(this->_bytes, shared);
+        putLength(this->_bytes, name.size() - shared);
+        this->_bytes.insert(this->_bytes.end(), name.begin() + shared,
+                            name.end());
+        prev = name;
+    }
+}
+
+// Lengths take 7 bits a byte, low bits first, the top bit marking that more
+// follow
+void CSNameIndex::putLength(std::vector<char>& bytes, size_t len) {
+    for (; len >= 0x80; len >>= 7)
+        bytes.push_back((char)(len | 0x80));
+    bytes.push_back((char)len);
+}
+
+size_t CSNameIndex::getLength(const char*& p) {
+    size_t len = 0;
+    for (int shift = 0;; shift += 7) {
+        uint8_t b = *p++;
+        len |= (size_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return len;
+    }
+}
+
+std::string_view CSNameIndex::head(size_t b) const {
+    const char* p = this->_bytes.data() + this->_buckets[b];
+    getLength(p);
+    size_t len = getLength(p);
+    return std::string_view(p, len);
+}
+
+std::vector<CSNameId> CSNameIndex::prefixed(std::string_view prefix) const {
+    std::vector<CSNameId> found;
+    if (this->_ids.empty())
+        return found;
+
+    // Names starting with 'prefix' begin in the last bucket whose first name
+    // sorts before it, or in the first bucket
+    size_t lo = 0, hi = this->_buckets.size();
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (head(mid) < prefix)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    std::string name;
+    scan(lo ? lo - 1 : 0, this->_buckets.size(),
+         [&](size_t i, size_t shared, std::string_view rest) {
+             name.resize(shared);
+             name.append(rest);
+             if (name.starts_with(prefix))
+                 found.push_back(this->_ids[i]);
+             else if (name > prefix)
+                 return false;
+             return true;
+         });
+    std::sort(found.begin(), found.end());
+    return found;
+}
+
+std::vector<CSNameId> CSNameIndex::matching(const CSRegex& re,
+                                            unsigned jobs) const {
+    size_t n_blocks =
+        (this->_buckets.size() + scan_buckets - 1) / scan_buckets;
+    std::vector<std::vector<CSNameId>> blocks(n_blocks);
+    parallelFor(n_blocks, jobs, [&](size_t b) {
+        // The DFA state after each byte of the last name
+        std::vector<uint32_t> states(1, re.start());
+        scan(b * scan_buckets, (b + 1) * scan_buckets,
+             [&](size_t i, size_t shared, std::string_view rest) {
+                 states.resize(shared + 1);
+                 for (char c : rest)
+                     states.push_back(re.next(states.back(), c));
+                 if (re.accepts(states.back()))
+                     blocks[b].push_back(this->_ids[i]);
+                 return true;
+             });
+    });
+
+    std::vector<CSNameId> found;
+    for (const std::vector<CSNameId>& block : blocks)
+        found.insert(found.end(), block.begin(), block.end());
+    std::sort(found.begin(), found.end());
+    return found;
+}
+
+static bool isMark(char c) {
+    return all_marks[(uint8_t)c];
+}
+
+// The symbol section is a list of file records.  From docs:
+//
+// <file mark><file path>
+// <empty line>
 //
 // and for each source line containing a symbol
 //
@@ -267,185 +1845,728 @@ static bool isMark(char c) {
 // Source:
 // ftp://ftp.eeng.dcu.ie/pub/ee454/cygwin/usr/share/doc/mlcscope-14.1.8/html/cscope.html
 //
-// Returns: function definition that was just added, or is being added to.
-static void loadSymbolsInFile(CSFile* file, pos_t* pos, long lineno) {
-    char line[1024], *c, mark;
-
-    // Suck in only function calls or definitions for this lineno
-    while (VALID(pos)) {
-        // Skip <non-symbol text> and obtain:
-        //
-        // <optional mark><symbol text>
-        // This will be <blank> if end of symbol data.
-        getLine(pos, line, sizeof(line));
-        if (strlen(line) == 0)
-            break;
+// The parser is a state machine over whole lines: each state is the kind of
+// line expected next, and the line found there picks the transition.
+
+// Parser states
+enum CSParseState : uint8_t {
+    PS_FILE,        // <file mark><file path>
+    PS_FILE_BLANK,  // <empty line> after the file path
+    PS_LINENO,      // <line number><blank><non-symbol text>, or the next file
+    PS_SYMBOL,      // <optional mark><symbol>, or the <empty line> ending them
+    PS_TEXT,        // <non-symbol text> after a symbol
+    PS_COUNT
+};
+
+// What a line turned out to be
+enum CSLineKind : uint8_t {
+    LK_EMPTY,     // Nothing on the line
+    LK_FILE,      // @<file path>
+    LK_FUNCTION,  // A function definition or call
+    LK_BARE,      // A function definition or call mark without a name
+    LK_OTHER,     // Anything else
+    LK_COUNT
+};
 
-        c = line;
+// What to do with a line
+enum CSParseAction : uint8_t {
+    PA_NONE,
+    PA_FILE,    // Start a new file record
+    PA_LINENO,  // Set the current line number
+    PA_SYMBOL,  // Emit a function definition or call
+};
+
+struct CSTransition {
+    CSParseState next;
+    CSParseAction action;
+};
 
-        // Skip spaces and not tabs
-        while (*c == ' ')
-            ++c;
+static constexpr CSTransition parse_table[PS_COUNT][LK_COUNT] = {
+    // PS_FILE: the whole line is the file record
+    {{PS_FILE_BLANK, PA_FILE},      // LK_EMPTY
+     {PS_FILE_BLANK, PA_FILE},      // LK_FILE
+     {PS_FILE_BLANK, PA_FILE},      // LK_FUNCTION
+     {PS_FILE_BLANK, PA_FILE},      // LK_BARE
+     {PS_FILE_BLANK, PA_FILE}},     // LK_OTHER
+    // PS_FILE_BLANK: skipped
+    {{PS_LINENO, PA_NONE},          // LK_EMPTY
+     {PS_LINENO, PA_NONE},          // LK_FILE
+     {PS_LINENO, PA_NONE},          // LK_FUNCTION
+     {PS_LINENO, PA_NONE},          // LK_BARE
+     {PS_LINENO, PA_NONE}},         // LK_OTHER
+    // PS_LINENO: a line number starts the symbols for a source line
+    {{PS_SYMBOL, PA_LINENO},        // LK_EMPTY
+     {PS_FILE_BLANK, PA_FILE},      // LK_FILE
+     {PS_SYMBOL, PA_LINENO},        // LK_FUNCTION
+     {PS_SYMBOL, PA_LINENO},        // LK_BARE
+     {PS_SYMBOL, PA_LINENO}},       // LK_OTHER
+    // PS_SYMBOL: only named symbols are followed by <non-symbol text>
+    {{PS_LINENO, PA_NONE},          // LK_EMPTY
+     {PS_SYMBOL, PA_NONE},          // LK_FILE
+     {PS_TEXT, PA_SYMBOL},          // LK_FUNCTION
+     {PS_SYMBOL, PA_SYMBOL},        // LK_BARE
+     {PS_SYMBOL, PA_NONE}},         // LK_OTHER
+    // PS_TEXT: skipped
+    {{PS_SYMBOL, PA_NONE},          // LK_EMPTY
+     {PS_SYMBOL, PA_NONE},          // LK_FILE
+     {PS_SYMBOL, PA_NONE},          // LK_FUNCTION
+     {PS_SYMBOL, PA_NONE},          // LK_BARE
+     {PS_SYMBOL, PA_NONE}},         // LK_OTHER
+};
+
+// A classified line.  'text' is the part the action needs: the file path for
+// a file record, the number for a line number, or the symbol name.
+struct CSLine {
+    CSLineKind kind;
+    char mark;
+    std::string_view text;
+};
+
+static std::string_view skipSpace(std::string_view s) {
+    while (!s.empty() && isspace((uint8_t)s[0]))
+        s.remove_prefix(1);
+    return s;
+}
 
-        // <optional mark>
-        mark = 0;
-        if (c[0] == '\t' && isMark(c[1])) {
-            mark = c[1];
-            c += 2;
+// Classify 'line' as the parser sees it in 'state'
+static CSLine classifyLine(CSParseState state, std::string_view line) {
+    CSLine l = {line.empty() ? LK_EMPTY : LK_OTHER, 0, line};
+
+    switch (state) {
+        case PS_FILE:
+        case PS_LINENO:
+            // <file mark><file path> or <line number>, after any whitespace
+            l.text = skipSpace(line);
+            if (state == PS_FILE || (!l.text.empty() && l.text[0] == '@')) {
+                l.kind = LK_FILE;
+                if (!l.text.empty()) {
+                    l.mark = l.text[0];
+                    l.text.remove_prefix(1);
+                }
+            }
+            break;
+        case PS_SYMBOL:
+            // Skip spaces and not tabs, then <optional mark>
+            while (!l.text.empty() && l.text[0] == ' ')
+                l.text.remove_prefix(1);
+            if (l.text.size() < 2 || l.text[0] != '\t' ||
+                (l.text[1] != CS_FN_DEF && l.text[1] != CS_FN_CALL))
+                break;
+            l.mark = l.text[1];
+            l.text.remove_prefix(2);
+
+            // Skip names that are only a mark character
+            if (l.text.empty())
+                l.kind = LK_BARE;
+            else if (l.text.size() > 1 || !isMark(l.text[0]))
+                l.kind = LK_FUNCTION;
+            break;
+        default:
+            // Skipped without looking inside
+            break;
+    }
+    return l;
+}
+
+// Where the parser is between two lines
+struct CSParser {
+    CSParseState state = PS_FILE;
+    long lineno = 0;
+};
+
+// Run the parser over the lines that start in [begin, end), continuing from
+// 'parser'.  Lines may run on past 'end' up to 'data_len'.  Calls
+// sink.file(name, mark) for each file record and sink.symbol(name, mark,
+// lineno) for each function definition or call, with names pointing into
+// 'data'.
+template <typename Sink>
+static void parseSymbols(const uint8_t* data,
+                         size_t begin,
+                         size_t end,
+                         size_t data_len,
+                         Sink& sink,
+                         CSParser& parser) {
+    const uint8_t* p = data + begin;
+
+    while (p < data + end) {
+        const uint8_t* nl = scan.findNewline(p, data + data_len);
+        CSLine line =
+            classifyLine(parser.state, {(const char*)p, (size_t)(nl - p)});
+        p = nl + 1;
+
+        CSTransition t = parse_table[parser.state][line.kind];
+        switch (t.action) {
+            case PA_FILE:
+                sink.file(line.text, line.mark);
+                break;
+            case PA_LINENO:
+                parser.lineno = 0;
+                std::from_chars(line.text.data(),
+                                line.text.data() + line.text.size(),
+                                parser.lineno);
+                break;
+            case PA_SYMBOL:
+                sink.symbol(line.text, line.mark, parser.lineno);
+                break;
+            case PA_NONE:
+                break;
         }
+        parser.state = t.next;
+    }
+}
 
-        // Only accept function definitions or function calls
-        if (!mark || (mark != CS_FN_DEF && mark != CS_FN_CALL))
+// Marks that matter for the call graph
+static constexpr CSMarkTable graph_marks = makeMarkTable("@$`");
+
+// Like parseSymbols(), but jump from one function or file mark straight to
+// the next without looking at the lines in between.  Lines that do not start
+// with a mark are skipped even if they are the <non-symbol text> a mark line
+// would otherwise be taken for, which cscope never writes.  Line numbers are
+// not read, symbols get 0.
+template <typename Sink>
+static void skipScanSymbols(const uint8_t* data,
+                            size_t begin,
+                            size_t end,
+                            size_t data_len,
+                            Sink& sink) {
+    const uint8_t* p = data + begin;
+
+    while ((p = scan.findMark(p, data + end, graph_marks)) < data + end) {
+        // Marks only count at the start of a line
+        if (p != data + begin && p[-1] != '\n') {
+            ++p;
             continue;
+        }
 
-        // Skip lines only containing mark characters
-        if (isMark(c[0]) && strlen(c + 1) == 0)
-            continue;
+        const uint8_t* nl = scan.findNewline(p, data + data_len);
+        std::string_view name((const char*)p + 2, nl - p - 2);
+        char mark = p[1];
+        if (mark == '@') {
+            // File records follow an <empty line>
+            if (p == data + begin || (p - data >= 2 && p[-2] == '\n'))
+                sink.file(name, mark);
+        } else if (name.size() != 1 || !isMark(name[0])) {
+            sink.symbol(name, mark, 0);
+        }
+        p = nl;
+    }
+}
 
-        if (mark == CS_FN_CALL) {
-            CSFuncDef* fndef = file->getCurrentFunction();
+// Extract the symbols of the file records in [begin, end), with the parser
+// or, for 'skip_scan', with skipScanSymbols()
+template <typename Sink>
+static void extractSymbols(const uint8_t* data,
+                           size_t begin,
+                           size_t end,
+                           size_t data_len,
+                           bool skip_scan,
+                           Sink& sink) {
+    if (skip_scan) {
+        skipScanSymbols(data, begin, end, data_len, sink);
+    } else {
+        CSParser parser;
+        parseSymbols(data, begin, end, data_len, sink, parser);
+    }
+}
+
+// 'name' with its digraphs expanded into 'scratch', or 'name' itself when it
+// has none
+static std::string_view expandDigraphs(std::string_view name,
+                                       std::string& scratch) {
+    if (countDigraphs(name) == 0)
+        return name;
+
+    scratch.clear();
+    for (uint8_t c : name) {
+        if (c & 0x80)
+            scratch.append(digraphs[c & 0x7f].data(), 2);
+        else
+            scratch.push_back(c);
+    }
+    return scratch;
+}
+
+// Builds files and their symbols out of parser events
+struct CSFileBuilder {
+    std::vector<CSFile>& files;
+    std::vector<CSSym>& syms;
+    CSStringPool& pool;
+    CSInterner& symbols;
+    bool copy_names;  // The database is unmapped once loading is done
+    bool compressed;  // Symbol names may contain digraphs
+    bool in_file = false;
+    bool in_function = false;
+    size_t n_functions = 0, file_functions = 0;
+
+    // Per name ID, the last definition (for calls) or file (for definitions)
+    // that used it, so that each is only added once
+    std::vector<uint32_t> called_by, defined_in;
+    uint32_t n_defs = 0, n_files = 0;
+    std::string expanded;
+
+    // The ID of 'name', interning it with any digraphs expanded
+    CSNameId intern(std::string_view name) {
+        std::string_view key = compressed ? expandDigraphs(name, expanded)
+                                          : name;
+        CSNameId id = symbols.find(key);
+        if (id == cs_no_name) {
+            // Keep the name for as long as the CS
+            if (copy_names || key.data() == expanded.data())
+                key = pool.copy(key);
+            id = symbols.add(key);
+        }
+
+        // Names may also have been added without the builder
+        if (id >= called_by.size()) {
+            called_by.resize(symbols.size());
+            defined_in.resize(symbols.size());
+        }
+        return id;
+    }
 
+    // File paths are written to the database uncompressed
+    void file(std::string_view name, char) {
+        finish();
+        files.push_back(
+            {copy_names ? pool.copy(name) : name, syms.size(), syms.size()});
+        in_file = true;
+        in_function = false;
+        file_functions = 0;
+        ++n_files;
+    }
+
+    void symbol(std::string_view name, char mark, long lineno) {
+        if (!in_file)
+            return;
+        if (mark == CS_FN_CALL) {
             // This is probably a macro
-            if (!fndef)
-                continue;
+            if (!in_function)
+                return;
 
-            // We always allocate a new symbol
-            // so the next pointer for a call will be used as a
-            // list of all calls that the function defintiion makes.
-            fndef->addCallee(new CSFuncCall(c, mark, lineno, file));
+            // Calls follow the definition making them, once per name
+            CSNameId id = intern(name);
+            if (called_by[id] == n_defs)
+                return;
+            called_by[id] = n_defs;
+            syms.push_back({id, (uint32_t)(files.size() - 1), (uint32_t)lineno,
+                            mark});
         } else if (mark == CS_FN_DEF) {
-            // Add fn definition to file: Most recently defined is first
-            file->addFunctionDef(new CSFuncDef(c, mark, lineno, file));
+            CSNameId id = intern(name);
+            if (defined_in[id] != n_files)
+                ++file_functions;
+            defined_in[id] = n_files;
+            ++n_defs;
+            in_function = true;
+            syms.push_back({id, (uint32_t)(files.size() - 1), (uint32_t)lineno,
+                            mark});
         }
+    }
 
-        if (strlen(c) == 0)
-            continue;
+    // Close the file being built
+    void finish() {
+        if (!in_file)
+            return;
+        in_file = false;
+
+        // No-name file
+        CSFile& f = files.back();
+        if (f.name.size() == 0) {
+            syms.resize(f.syms_begin);
+            files.pop_back();
+        } else {
+            f.syms_end = syms.size();
+            n_functions += file_functions;
+        }
+    }
+};
 
-        // <non-symbol text>
-        getLine(pos, line, sizeof(line));
+// Find the first file record at or after 'off': a "\t@" line that follows an
+// empty line.  Returns 'end' if there is none.
+static size_t nextFileRecord(const uint8_t* data, size_t off, size_t end) {
+    const uint8_t* p = data + off;
+    while ((p = scan.findMark(p, data + end, file_marks)) < data + end) {
+        if (p - data >= 2 && p[-1] == '\n' && p[-2] == '\n')
+            return p - data;
+        ++p;
     }
+    return end;
 }
 
-// Extract the symbols for file
-// This must start with the <mark><file> line.
-static void fileLoadSymbols(CSFile* file, pos_t* pos) {
-    long lineno;
-    char line[1024], *c;
+// Split the symbol section [start, end) into chunks for 'jobs' threads, at
+// file record boundaries.  Returns the offset each chunk starts at.
+static std::vector<size_t> chunkBounds(const uint8_t* data,
+                                       size_t start,
+                                       size_t end,
+                                       unsigned jobs) {
+    std::vector<size_t> bounds = {start};
+
+    // A few chunks per thread keeps the workers busy when file sizes vary
+    if (end > start && jobs > 1) {
+        size_t n_chunks = jobs * 4;
+        size_t chunk_len = (end - start) / n_chunks;
+        for (size_t i = 1; i < n_chunks; ++i) {
+            size_t off = std::max(start + i * chunk_len, bounds.back() + 1);
+            off = nextFileRecord(data, off, end);
+            if (off >= end)
+                break;
+            bounds.push_back(off);
+        }
+    }
+    return bounds;
+}
 
-    DBG("Loading: %s", file->name);
+// Find the start of the file record containing 'off'
+static size_t fileRecordAt(const uint8_t* data, size_t syms_start, size_t off) {
+    const uint8_t* p = data + off;
+    while (p > data + syms_start) {
+        p = (const uint8_t*)memrchr(data + syms_start, '@',
+                                    p - (data + syms_start));
+        if (!p)
+            break;
+        size_t rec = p - data - 1;  // The record starts at the '\t'
+        if (p[-1] == '\t' &&
+            (rec == syms_start ||
+             (data[rec - 1] == '\n' && data[rec - 2] == '\n')))
+            return rec;
+    }
+    return syms_start;
+}
 
-    // <empty line>
-    getLine(pos, line, sizeof(line));
+// Open a cscope database with the backend in 'opts' and read its header and
+// trailer.  The symbols are read by load().  'name' is the database path, or
+// null for stdin.  Input that can not be mapped, like a pipe, is streamed.
+CS::CS(FILE* fp, const char* name, const CSOptions& opts)
+    : _hdr(),
+      _name(name),
+      _n_functions(0),
+      _opts(opts),
+      _data(nullptr),
+      _data_len(0),
+      _backend(cs_backend_names[opts.backend]),
+      _start(std::chrono::steady_clock::now()) {
+    struct stat st;
+    std::unique_ptr<CSSource> source;
+
+    if (fstat(fileno(fp), &st) == -1 || !S_ISREG(st.st_mode)) {
+        this->_backend = "stdio";
+        source = std::make_unique<CSFileSource>(fp);
+    } else if (opts.backend == CS_URING) {
+#ifdef CS_HAVE_URING
+        source = CSUringSource::open(fp, st.st_size);
+#endif
+        if (!source) {
+            ERR("io_uring is not available, using pread");
+            this->_backend = cs_backend_names[CS_PREAD];
+        }
+    }
+    if (!source && S_ISREG(st.st_mode) && opts.backend != CS_MMAP)
+        source = std::make_unique<CSPreadSource>(fp, st.st_size);
+
+    if (source) {
+        // Only the header is needed up front, the rest is read by load()
+        this->_stream = std::make_unique<CSStream>(std::move(source));
+        std::string_view head = this->_stream->lines();
+        initHeader((const uint8_t*)head.data(), head.size());
+        this->_stream->consume(this->_hdr.syms_start);
+        return;
+    }
+
+    // mmap the input cscope database.  A full load reads all of it in order,
+    // while the lazy and indexed loads jump to the records they need.
+    bool whole = !opts.lazy && !opts.use_index;
+    this->_data = (uint8_t*)mmap(NULL, st.st_size, PROT_READ,
+                                 MAP_PRIVATE | (whole ? MAP_POPULATE : 0),
+                                 fileno(fp), 0);
+    if (this->_data == MAP_FAILED) {
+        std::cerr << "Error memory maping cscope database" << std::endl;
+        exit(errno);
+    }
+    this->_data_len = st.st_size;
+    fclose(fp);
+    madvise(this->_data, this->_data_len,
+            whole ? MADV_SEQUENTIAL : MADV_RANDOM);
+#ifdef MADV_HUGEPAGE
+    // Only honoured where the kernel supports huge pages for file mappings
+    madvise(this->_data, this->_data_len, MADV_HUGEPAGE);
+#endif
+
+    // Initialize the data
+    initHeader(this->_data, this->_data_len);
+    initTrailer(this->_data, this->_data_len);
+}
 
-    // Now parse symbol information for eack line in 'file'
-    while (VALID(pos)) {
-        // Either this is a symbol, or a file.  If this is a file, then we are
-        // done processing the current file.  So, in that case we break and
-        // restore the position at the start of the next file's data:
-        // <mark><file> line.
-        //
-        // So there are two cases here:
-        // 1) New set of symbols: <lineno><blank><non-symbol text>
-        // 2) A new file: <mark><file>
-        getLine(pos, line, sizeof(line));
-        c = line;
-        while (isspace(*c))
-            ++c;
+void CS::load(const CSQuery& query) {
+    bool loaded = this->_opts.use_index && loadIndexed(query);
+    if (!loaded && this->_opts.lazy)
+        loaded = loadLazy(query);
+    if (!loaded) {
+        if (this->_stream)
+            streamSymbols();
+        else
+            initSymbols(this->_data, this->_data_len);
+
+        // Build database, the first file defining a name has its entry
+        startSpinner("Building internal database", "Built internal database");
+        this->_db.assign(this->symbols.size(), cs_no_sym);
+        for (CSSymIdx i = 0; i < this->syms.size(); ++i) {
+            const CSSym& sym = this->syms[i];
+            if (sym.mark == CS_FN_DEF && this->_db[sym.id] == cs_no_sym)
+                this->_db[sym.id] = i;
+        }
+        stopSpinner();
+    }
+    this->graph = CSGraph(this->_db, this->syms);
+    this->_db = CSDB();
 
-        // Case 2: New file
-        if (c[0] == '@') {
-            pos->off -= strlen(line);
-            return;
+    if (logging) {
+        size_t bytes =
+            this->_stream ? this->_stream->offset() : this->_data_len;
+        std::chrono::duration<double> secs =
+            std::chrono::steady_clock::now() - this->_start;
+        std::cout << std::format("Loaded {:.1f} MB with {} at {:.0f} MB/s",
+                                 bytes / 1e6, this->_backend,
+                                 bytes / 1e6 / secs.count())
+                  << std::endl;
+
+        size_t used = 0, reserved = 0;
+        for (const CSStringPool& pool : this->_pools) {
+            used += pool.bytes();
+            reserved += pool.reserved();
         }
+        std::cout << std::format(
+                         "Holding {} symbols in {:.1f} MB, copied names in "
+                         "{:.1f} MB ({:.1f} MB reserved)",
+                         this->syms.size(),
+                         this->syms.capacity() * sizeof(CSSym) / 1e6,
+                         used / 1e6, reserved / 1e6)
+                  << std::endl;
+    }
 
-        // Case 1: Symbols at line!
-        // <line number><blank>
-        lineno = atol(c);
-        loadSymbolsInFile(file, pos, lineno);
+    // Done loading data, unless the symbol names still point into it
+    this->_stream.reset();
+    if (this->_data && !this->_opts.keep_mapped) {
+        munmap(this->_data, this->_data_len);
+        this->_data = nullptr;
     }
 }
 
-// Load a cscope database and return a pointer to the data
-CS::CS(FILE* fp) {
-    uint8_t* data;
-    struct stat st;
+CS::~CS() {
+    if (this->_data)
+        munmap(this->_data, this->_data_len);
+}
 
-    // mmap the input cscope database
-    fstat(fileno(fp), &st);
-    data =
-        (uint8_t*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
-    if (data == NULL) {
-        std::cerr << "Error memory maping cscope database" << std::endl;
-        exit(errno);
+CSNameId CS::findFunction(std::string_view fn_name) const {
+    CSNameId fn = this->symbols.find(fn_name);
+    return fn < this->graph.size() ? fn : cs_no_name;
+}
+
+std::vector<CSNameId> CS::findFunctions(std::string_view pattern) const {
+    if (!isPrefixPattern(pattern)) {
+        CSNameId fn = findFunction(pattern);
+        if (fn == cs_no_name)
+            return {};
+        return {fn};
     }
 
-    // Initialize the data
-    initHeader(data, st.st_size);
-    initTrailer(data, st.st_size);
-    initSymbols(data, st.st_size);
+    // Names built with cscope -T only match on their first 8 characters
+    pattern.remove_suffix(1);
+    if (this->_hdr.prefix_match && pattern.size() > 8)
+        pattern = pattern.substr(0, 8);
+    return names().prefixed(pattern);
+}
 
-    // Done loading data
-    munmap(data, st.st_size);
-    fclose(fp);
+std::vector<CSNameId> CS::findMatching(const CSRegex& re) const {
+    return names().matching(re, this->_opts.jobs);
+}
 
-    // Build database
-    this->db = new CSDB;
+const CSNameIndex& CS::names() const {
+    std::call_once(this->_names_once, [this]() {
+        std::vector<CSNameId> defined;
+        for (const CSSym& sym : this->syms)
+            if (sym.mark == CS_FN_DEF && sym.id < this->graph.size())
+                defined.push_back(sym.id);
+        std::sort(defined.begin(), defined.end());
+        defined.erase(std::unique(defined.begin(), defined.end()),
+                      defined.end());
+        this->_names =
+            CSNameIndex(this->symbols, defined, this->_opts.jobs);
+    });
+    return this->_names;
+}
 
-    startSpinner("Building internal database", "Built internal database");
-    for (auto f : this->files) {
-        for (auto fndef_pr : *f->getFunctions()) {
-            // Collect all calls this function (fndef) makes
-            std::vector<const CSFuncCall*> callees;
-            auto fndef = static_cast<const CSFuncDef*>(fndef_pr.second);
-            fndef->getCallees(callees);
+const CSComponents& CS::components() const {
+    std::call_once(this->_components_once, [this]() {
+        this->_components = CSComponents(this->graph);
+    });
+    return this->_components;
+}
 
-            // Add the funtion_def : calleess map entry
-            auto pr = std::make_pair(fndef->getName(), callees);
-            this->db->insert(pr);
-        }
-    }
-    stopSpinner();
+// A traversal for one query, reused if an earlier query left one
+std::unique_ptr<CSTraversal> CS::takeTraversal() const {
+    std::lock_guard<std::mutex> lock(this->_traversals_mutex);
+    if (this->_traversals.empty())
+        return std::make_unique<CSTraversal>(this->graph);
+    std::unique_ptr<CSTraversal> traversal =
+        std::move(this->_traversals.back());
+    this->_traversals.pop_back();
+    return traversal;
 }
 
-// Does a call b?
-static bool isCallerOf(CSDB* db, const char* a, const char* b) {
-    // All the functions 'a' calls
-    for (auto callee : (*db)[a]) {
-        if (strcmp(callee->getName().c_str(), b) == 0)
-            return true;
+void CS::keepTraversal(std::unique_ptr<CSTraversal> traversal) const {
+    std::lock_guard<std::mutex> lock(this->_traversals_mutex);
+    this->_traversals.push_back(std::move(traversal));
+}
+
+// Collect the edges within 'depth' calls of 'fns' in direction 'dir'
+std::string CS::getEdges(std::span<const CSNameId> fns,
+                         int depth,
+                         CSDirection dir,
+                         unsigned jobs) const {
+    std::string out = "";
+    if (fns.empty())
+        return out;
+    if (!jobs)
+        jobs = this->_opts.jobs;
+
+    // Edges are formatted by the threads that find them
+    auto edge = [&](std::string& part, CSNameId from, CSNameId to) {
+        if (dir == CS_CALLERS)
+            std::swap(from, to);
+        part.append(std::format("    {} -> {}\n", this->symbols.name(from),
+                                this->symbols.name(to)));
+    };
+    std::unique_ptr<CSTraversal> traversal = takeTraversal();
+    if (depth != cs_unbounded) {
+        traversal->run<std::string>(
+            fns, depth, dir, jobs, edge,
+            [&](std::string& part) { out.append(part); });
+        keepTraversal(std::move(traversal));
+        return out;
     }
 
-    return false;
+    // Calls within a cycle give way to its cluster, drawn when it is first
+    // reached.  Clusters are drawn while joining, at the place in a part's
+    // edges where its block reached them.  The members of a large cycle are
+    // formatted in blocks on the query's threads, as its edges are.
+    const CSComponents& scc = components();
+    std::vector<bool> drawn(scc.size());
+    std::vector<std::string> member_parts;
+    auto cluster = [&](uint32_t c) {
+        static constexpr size_t block_size = 4096;
+        std::span<const CSNameId> members = scc.members(c);
+        if (drawn[c] || members.size() == 1)
+            return;
+        drawn[c] = true;
+        out.append(std::format("    subgraph cluster_{} {{\n", c));
+        out.append("        label = \"cycle\";\n");
+        size_t n_blocks = (members.size() + block_size - 1) / block_size;
+        member_parts.resize(n_blocks);
+        parallelFor(n_blocks, jobs, [&](size_t b) {
+            size_t end = std::min(members.size(), (b + 1) * block_size);
+            for (size_t i = b * block_size; i < end; ++i)
+                member_parts[b].append(std::format(
+                    "        {};\n", this->symbols.name(members[i])));
+        });
+        for (size_t b = 0; b < n_blocks; ++b) {
+            out.append(member_parts[b]);
+            member_parts[b].clear();
+        }
+        out.append("    }\n");
+    };
+    struct Part {
+        std::string edges;
+        std::vector<std::pair<size_t, uint32_t>> cycles;  // Offset, cycle
+    };
+    auto visit = [&](Part& part, CSNameId id, CSNameId next) {
+        uint32_t c = scc.of(next);
+        if (scc.members(c).size() > 1)
+            part.cycles.emplace_back(part.edges.size(), c);
+        if (c != scc.of(id) || scc.members(c).size() == 1)
+            edge(part.edges, id, next);
+    };
+    auto join = [&](Part& part) {
+        size_t joined = 0;
+        for (auto [at, c] : part.cycles) {
+            out.append(part.edges, joined, at - joined);
+            joined = at;
+            cluster(c);
+        }
+        out.append(part.edges, joined);
+    };
+    for (CSNameId fn : fns)
+        cluster(scc.of(fn));
+    traversal->run<Part>(fns, depth, dir, jobs, visit, join);
+    keepTraversal(std::move(traversal));
+    return out;
 }
 
-// Collect all of the callers to 'fn_name'
-static std::string getCallersRec(CSDB* db, const char* fn_name, int depth) {
-    if (depth <= 0)
-        return "";
+std::string CS::getPaths(CSNameId from, CSNameId to) const {
     std::string out = "";
-    for (auto pr : *db) {
-        const char* item = pr.first.c_str();
-        // Does 'item' call 'fn_name' ?
-        if (isCallerOf(db, item, fn_name)) {
-            out.append(std::format("    {} -> {}\n", item, fn_name));
-            out.append(getCallersRec(db, item, depth - 1));
+    if (from == cs_no_name || to == cs_no_name)
+        return out;
+    std::vector<std::vector<CSNameId>> levels =
+        CSPaths(this->graph).shortest(from, to);
+    for (size_t i = 0; i + 1 < levels.size(); ++i) {
+        for (CSNameId id : levels[i]) {
+            for (CSNameId callee : this->graph.callees(id)) {
+                if (std::binary_search(levels[i + 1].begin(),
+                                       levels[i + 1].end(), callee))
+                    out.append(std::format("    {} -> {}\n",
+                                           this->symbols.name(id),
+                                           this->symbols.name(callee)));
+            }
         }
     }
     return out;
 }
 
-// Collect all of the callees to 'fn_name'
-static std::string getCalleesRec(CSDB* db, const char* fn_name, int depth) {
-    if (depth <= 0)
-        return "";
+std::string CS::getChains(CSNameId from,
+                          CSNameId to,
+                          size_t count,
+                          uint32_t length,
+                          bool all) const {
     std::string out = "";
-    for (auto callee : (*db)[fn_name]) {
-        out.append(std::format("    {} -> {}\n", fn_name, callee->getName()));
-        out.append(getCalleesRec(db, callee->getName().c_str(), depth - 1));
+    if (from == cs_no_name || to == cs_no_name)
+        return out;
+    CSPaths paths(this->graph);
+    for (const CSPaths::Chain& chain :
+         all ? paths.simple(from, to, count, length)
+             : paths.kShortest(from, to, count, length)) {
+        out.append("   ");
+        for (size_t i = 0; i < chain.size(); ++i)
+            out.append(std::format(" {}{}", i ? "-> " : "",
+                                   this->symbols.name(chain[i])));
+        out.append("\n");
     }
     return out;
 }
 
+// Collect all of the callers to 'fn'
+std::string CS::getCallers(CSNameId fn, int depth, unsigned jobs) const {
+    if (fn == cs_no_name)
+        return "";
+    return getEdges({&fn, 1}, depth, CS_CALLERS, jobs);
+}
+
+// Collect all of the callees to 'fn'
+std::string CS::getCallees(CSNameId fn, int depth, unsigned jobs) const {
+    if (fn == cs_no_name)
+        return "";
+    return getEdges({&fn, 1}, depth, CS_CALLEES, jobs);
+}
+
+std::string CS::getCallers(std::span<const CSNameId> fns,
+                           int depth,
+                           unsigned jobs) const {
+    return getEdges(fns, depth, CS_CALLERS, jobs);
+}
+
+std::string CS::getCallees(std::span<const CSNameId> fns,
+                           int depth,
+                           unsigned jobs) const {
+    return getEdges(fns, depth, CS_CALLEES, jobs);
+}
+
 // Header looks like:
 //     <cscope> <dir> <version> [-c] [-q <symbols>] [-T] <trailer>
 void CS::initHeader(const uint8_t* data, size_t data_len) {
@@ -473,15 +2594,19 @@ void CS::initHeader(const uint8_t* data, size_t data_len) {
     this->_hdr.dir = strndup(strtok(NULL, " "), 1024);
 
     // Optionals: [-c] [-T] [-q <syms>]
+    // cscope writes -c when it was told not to compress the database
+    this->_hdr.compression = true;
     while ((tok = strtok(NULL, " "))) {
         if (tok[0] == '-' && strlen(tok) == 2) {
             if (tok[1] == 'c')
-                this->_hdr.compression = true;
+                this->_hdr.compression = false;
             else if (tok[1] == 'T')
                 this->_hdr.prefix_match = true;
-            else if (tok[1] == 'q')
-                this->_hdr.inverted_index = true;  // TODO
-            else {
+            else if (tok[1] == 'q') {
+                // -q is followed by the number of symbols in the index
+                this->_hdr.inverted_index = true;
+                strtok(NULL, " ");
+            } else {
                 ERR("Unrecognized header option");
                 return;
             }
@@ -530,42 +2655,1109 @@ void CS::initTrailer(const uint8_t* data, size_t data_len) {
     }
 }
 
+// The symbol section is split into chunks at file record boundaries which are
+// parsed in parallel.  Each chunk collects its own files, symbols and names,
+// and the chunks are merged in database order, so the result matches a
+// single-threaded parse: names get their IDs in the order they first appear.
 void CS::initSymbols(const uint8_t* data, size_t data_len) {
-    pos_t pos = {0};
-    char line[1024];
-    CSFile* file;
+    size_t end = std::min(this->_hdr.trailer, data_len);
+    std::vector<size_t> bounds =
+        chunkBounds(data, this->_hdr.syms_start, end, this->_opts.jobs);
+
+    // Every chunk but the last stops at the next chunk's first record
+    std::vector<std::vector<CSFile>> chunk_files(bounds.size());
+    std::vector<std::vector<CSSym>> chunk_syms(bounds.size());
+    std::vector<size_t> chunk_functions(bounds.size());
+    std::vector<CSInterner> chunk_symbols(bounds.size());
+    this->_pools.resize(bounds.size());
+    parallelFor(bounds.size(), this->_opts.jobs, [&](size_t i) {
+        size_t chunk_end = i + 1 < bounds.size() ? bounds[i + 1] : end;
+        CSFileBuilder builder = {chunk_files[i], chunk_syms[i],
+                                 this->_pools[i], chunk_symbols[i],
+                                 !this->_opts.keep_mapped,
+                                 this->_hdr.compression};
+        extractSymbols(data, bounds[i], chunk_end, data_len,
+                       this->_opts.skip_scan, builder);
+        builder.finish();
+        chunk_functions[i] = builder.n_functions;
+    });
+
+    // Chunk IDs move to the global ones.  The first chunk needs no renaming,
+    // its IDs are the first ones.
+    std::vector<std::vector<CSNameId>> to(bounds.size());
+    std::vector<size_t> file_base(bounds.size() + 1);
+    std::vector<size_t> sym_base(bounds.size() + 1);
+    for (size_t i = 0; i < bounds.size(); ++i) {
+        const CSInterner& local = chunk_symbols[i];
+        to[i].resize(local.size());
+        for (CSNameId id = 0; id < local.size(); ++id) {
+            to[i][id] = this->symbols.find(local.name(id));
+            if (to[i][id] == cs_no_name)
+                to[i][id] = this->symbols.add(local.name(id));
+        }
+        file_base[i + 1] = file_base[i] + chunk_files[i].size();
+        sym_base[i + 1] = sym_base[i] + chunk_syms[i].size();
+        this->_n_functions += chunk_functions[i];
+    }
 
-    pos.off = this->_hdr.syms_start;
-    pos.data = data;
-    pos.data_len = data_len;
+    this->files.resize(file_base.back());
+    this->syms.resize(sym_base.back());
+    parallelFor(bounds.size(), this->_opts.jobs, [&](size_t i) {
+        for (size_t f = 0; f < chunk_files[i].size(); ++f) {
+            CSFile file = chunk_files[i][f];
+            file.syms_begin += sym_base[i];
+            file.syms_end += sym_base[i];
+            this->files[file_base[i] + f] = file;
+        }
+        for (size_t n = 0; n < chunk_syms[i].size(); ++n) {
+            CSSym sym = chunk_syms[i][n];
+            sym.id = to[i][sym.id];
+            sym.file += file_base[i];
+            this->syms[sym_base[i] + n] = sym;
+        }
+        chunk_syms[i] = std::vector<CSSym>();
+    });
+}
 
-    while (VALID(&pos) && pos.off <= this->_hdr.trailer) {
-        // Get file info
-        getLine(&pos, line, sizeof(line));
-        file = newFile(line);
-        fileLoadSymbols(file, &pos);
+// Parse the symbol section as it is read.  Only the buffered lines are held
+// at once, so symbol names are always copied.  The trailer is not read, it is
+// only logged when debugging.
+void CS::streamSymbols() {
+    startSpinner("Reading symbols", "Read symbols");
+    this->_pools.resize(1);
+    CSFileBuilder builder = {this->files,
+                             this->syms,
+                             this->_pools[0],
+                             this->symbols,
+                             true,
+                             this->_hdr.compression};
+    CSParser parser;
+    size_t end = this->_hdr.trailer;
+
+    std::string_view lines;
+    while (this->_stream->offset() < end &&
+           !(lines = this->_stream->lines()).empty()) {
+        auto data = (const uint8_t*)lines.data();
+        size_t stop = std::min(lines.size(), end - this->_stream->offset());
+        if (this->_opts.skip_scan)
+            skipScanSymbols(data, 0, stop, lines.size(), builder);
+        else
+            parseSymbols(data, 0, stop, lines.size(), builder, parser);
+        this->_stream->consume(lines.size());
+    }
+    builder.finish();
+    this->_n_functions += builder.n_functions;
+    stopSpinner();
+}
 
-        // No-name file
-        if (file->getName().size() == 0) {
-            delete file;
+CSStream::CSStream(std::unique_ptr<CSSource> source)
+    : _source(std::move(source)),
+      _buf(new uint8_t[initial_size]),
+      _size(initial_size) {}
+
+std::string_view CSStream::lines() {
+    for (;;) {
+        while (!this->_eof && this->_len < this->_size) {
+            size_t n = this->_source->read(this->_buf.get() + this->_len,
+                                           this->_size - this->_len);
+            if (n == 0)
+                this->_eof = true;
+            this->_len += n;
+        }
+
+        auto nl = (const uint8_t*)memrchr(this->_buf.get(), '\n', this->_len);
+        if (nl)
+            return {(const char*)this->_buf.get(),
+                    (size_t)(nl - this->_buf.get()) + 1};
+        if (this->_eof)
+            return {(const char*)this->_buf.get(), this->_len};
+
+        // A single line fills the buffer
+        auto bigger = std::make_unique<uint8_t[]>(this->_size * 2);
+        memcpy(bigger.get(), this->_buf.get(), this->_len);
+        this->_buf = std::move(bigger);
+        this->_size *= 2;
+    }
+}
+
+void CSStream::consume(size_t n) {
+    n = std::min(n, this->_len);
+    memmove(this->_buf.get(), this->_buf.get() + n, this->_len - n);
+    this->_len -= n;
+    this->_offset += n;
+}
+
+// Give up on a database that can not be read, failing with 'err'
+[[noreturn]] static void readFailed(int err) {
+    // The spinner's thread must be joined before exit() destroys it
+    spinnerDoneMessage = "";
+    stopSpinner();
+    std::cerr << "Error reading cscope database: " << strerror(err)
+              << std::endl;
+    exit(err);
+}
+
+size_t CSFileSource::read(uint8_t* dst, size_t len) {
+    size_t n = fread(dst, 1, len, this->_fp);
+    if (n == 0 && ferror(this->_fp))
+        readFailed(errno);
+    return n;
+}
+
+// pread all of [off, off + len) unless the file ends first.  Returns the bytes
+// read, or -errno on error, as it may run on another thread.
+static ssize_t preadFull(int fd, uint8_t* dst, size_t len, size_t off) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, dst + done, len - done, off + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -errno;
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+CSPreadSource::CSPreadSource(FILE* fp, size_t size) : _fp(fp), _size(size) {
+    this->_blocks[0].reset(new uint8_t[block_size]);
+    this->_blocks[1].reset(new uint8_t[block_size]);
+    readAhead();
+}
+
+CSPreadSource::~CSPreadSource() {
+    if (this->_next.valid())
+        this->_next.wait();
+    fclose(this->_fp);
+}
+
+// Start reading the next block into the one not being consumed
+void CSPreadSource::readAhead() {
+    if (this->_next_off >= this->_size)
+        return;
+    int fd = fileno(this->_fp);
+    uint8_t* dst = this->_blocks[this->_cur ^ 1].get();
+    size_t off = this->_next_off;
+    size_t len = std::min(block_size, this->_size - off);
+    this->_next_off += len;
+    this->_next = std::async(std::launch::async,
+                             [=] { return preadFull(fd, dst, len, off); });
+}
+
+size_t CSPreadSource::read(uint8_t* dst, size_t len) {
+    if (this->_pos == this->_len) {
+        if (!this->_next.valid())
+            return 0;
+        ssize_t n = this->_next.get();
+        if (n < 0)
+            readFailed(-n);
+        if (n == 0)
+            return 0;
+        this->_cur ^= 1;
+        this->_pos = 0;
+        this->_len = n;
+        readAhead();
+    }
+
+    size_t n = std::min(len, this->_len - this->_pos);
+    memcpy(dst, this->_blocks[this->_cur].get() + this->_pos, n);
+    this->_pos += n;
+    return n;
+}
+
+#ifdef CS_HAVE_URING
+std::unique_ptr<CSUringSource> CSUringSource::open(FILE* fp, size_t size) {
+    std::unique_ptr<CSUringSource> source(new CSUringSource(fp, size));
+    if (!source->setup()) {
+        // Leave 'fp' to the caller
+        source->_fp = nullptr;
+        return nullptr;
+    }
+
+    for (unsigned i = 0; i < depth; ++i) {
+        source->_blocks[i].buf.reset(new uint8_t[block_size]);
+        source->submit(i);
+    }
+    return source;
+}
+
+// Map the submission and completion rings, see io_uring_setup(2)
+bool CSUringSource::setup() {
+    io_uring_params p = {};
+    this->_ring = syscall(__NR_io_uring_setup, depth, &p);
+    if (this->_ring < 0)
+        return false;
+
+    this->_sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    this->_cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+        this->_sq_ring_len = this->_cq_ring_len =
+            std::max(this->_sq_ring_len, this->_cq_ring_len);
+
+    this->_sq_ring = mmap(nullptr, this->_sq_ring_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, this->_ring,
+                          IORING_OFF_SQ_RING);
+    if (this->_sq_ring == MAP_FAILED)
+        return false;
+    if (!single) {
+        this->_cq_ring =
+            mmap(nullptr, this->_cq_ring_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, this->_ring, IORING_OFF_CQ_RING);
+        if (this->_cq_ring == MAP_FAILED)
+            return false;
+    }
+    this->_sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+    this->_sqes = (io_uring_sqe*)mmap(nullptr, this->_sqes_len,
+                                      PROT_READ | PROT_WRITE,
+                                      MAP_SHARED | MAP_POPULATE, this->_ring,
+                                      IORING_OFF_SQES);
+    if (this->_sqes == MAP_FAILED)
+        return false;
+
+    auto sq = (uint8_t*)this->_sq_ring;
+    auto cq = (uint8_t*)(single ? this->_sq_ring : this->_cq_ring);
+    this->_sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    this->_sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    this->_sq_array = (unsigned*)(sq + p.sq_off.array);
+    this->_cq_head = (unsigned*)(cq + p.cq_off.head);
+    this->_cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    this->_cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    this->_cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    // Rings can be set up since Linux 5.1, but reads and the probe for them
+    // only came in 5.6
+    size_t probe_len =
+        sizeof(io_uring_probe) + IORING_OP_LAST * sizeof(io_uring_probe_op);
+    std::unique_ptr<uint8_t[]> probe_buf(new uint8_t[probe_len]());
+    auto probe = (io_uring_probe*)probe_buf.get();
+    return syscall(__NR_io_uring_register, this->_ring, IORING_REGISTER_PROBE,
+                   probe, IORING_OP_LAST) == 0 &&
+           probe->last_op >= IORING_OP_READ &&
+           (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+}
+
+CSUringSource::~CSUringSource() {
+    // The kernel may still be writing into the blocks
+    while (this->_in_flight > 0 && reap(true))
+        ;
+    if (this->_sqes != MAP_FAILED)
+        munmap(this->_sqes, this->_sqes_len);
+    if (this->_cq_ring != MAP_FAILED)
+        munmap(this->_cq_ring, this->_cq_ring_len);
+    if (this->_sq_ring != MAP_FAILED)
+        munmap(this->_sq_ring, this->_sq_ring_len);
+    if (this->_ring >= 0)
+        close(this->_ring);
+    if (this->_fp)
+        fclose(this->_fp);
+}
+
+// Queue a read of the next block into block 'i'
+void CSUringSource::submit(unsigned i) {
+    Block& b = this->_blocks[i];
+    b.off = this->_next_off;
+    b.len = std::min(block_size, this->_size - b.off);
+    b.done = false;
+    if (b.len == 0)
+        return;
+    this->_next_off += b.len;
+
+    unsigned tail = *this->_sq_tail;
+    unsigned idx = tail & *this->_sq_mask;
+    io_uring_sqe* sqe = &this->_sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fileno(this->_fp);
+    sqe->addr = (uintptr_t)b.buf.get();
+    sqe->len = b.len;
+    sqe->off = b.off;
+    sqe->user_data = i;
+    this->_sq_array[idx] = idx;
+    __atomic_store_n(this->_sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    if (syscall(__NR_io_uring_enter, this->_ring, 1, 0, 0, nullptr, 0) < 0) {
+        b.result = -errno;
+        b.done = true;
+        return;
+    }
+    ++this->_in_flight;
+}
+
+// Collect finished reads, waiting for one if 'wait'.  Returns false if the
+// ring failed.
+bool CSUringSource::reap(bool wait) {
+    if (wait && syscall(__NR_io_uring_enter, this->_ring, 0, 1,
+                        IORING_ENTER_GETEVENTS, nullptr, 0) < 0 &&
+        errno != EINTR)
+        return false;
+
+    unsigned head = *this->_cq_head;
+    unsigned tail = __atomic_load_n(this->_cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        const io_uring_cqe& cqe = this->_cqes[head & *this->_cq_mask];
+        Block& b = this->_blocks[cqe.user_data];
+        b.result = cqe.res;
+        b.done = true;
+        --this->_in_flight;
+    }
+    __atomic_store_n(this->_cq_head, head, __ATOMIC_RELEASE);
+    return true;
+}
+
+size_t CSUringSource::read(uint8_t* dst, size_t len) {
+    Block& b = this->_blocks[this->_cur];
+    if (b.len == 0)
+        return 0;
+    while (!b.done)
+        if (!reap(true))
+            readFailed(errno);
+    if (b.result >= 0 && (size_t)b.result < b.len) {
+        // Short read, finish the block synchronously
+        ssize_t n = preadFull(fileno(this->_fp), b.buf.get() + b.result,
+                              b.len - b.result, b.off + b.result);
+        b.result = n < 0 ? n : b.result + n;
+    }
+    if (b.result < 0)
+        readFailed(-b.result);
+
+    size_t n = std::min(len, (size_t)b.result - this->_pos);
+    memcpy(dst, b.buf.get() + this->_pos, n);
+    this->_pos += n;
+
+    // Reuse the block for the read after the queued ones
+    if (this->_pos == (size_t)b.result) {
+        submit(this->_cur);
+        this->_cur = (this->_cur + 1) % depth;
+        this->_pos = 0;
+    }
+    return n;
+}
+#endif
+
+// cscope.in.out starts with this header, see invlib.h in cscope
+struct CSInvParam {
+    int version;
+    int filestat;
+    long sizeblk;    // Size of a logical block
+    long startbyte;  // Offset of the superfinger
+    long supsize;    // Size of the superfinger
+    long cntlsize;   // Offset of the first logical block
+    long share;
+};
+
+// A term in a logical block.  The block starts with three longs (the entry
+// count and two links), then the entries.  Terms are packed from the end of
+// the block, each padded to a long and followed by a long holding the offset
+// of its postings in cscope.po.out.
+struct CSInvEntry {
+    short offset;  // Offset of the term in the block
+    unsigned char size;
+    unsigned char space;
+    long post;  // Number of postings
+};
+
+// A posting in cscope.po.out
+struct CSInvPosting {
+    long lineoffset;
+    long fcnoffset;
+    long fileindex : 24;
+    long type : 8;
+};
+
+static constexpr int inv_version = 1;
+
+// Read a T out of possibly unaligned mapped memory
+template <typename T>
+static T readAt(const uint8_t* p) {
+    T v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Map all of 'path' read-only.  Returns null on failure.
+static const uint8_t* mapFile(const std::string& path, size_t* len) {
+    struct stat st;
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+
+    void* data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return nullptr;
+
+    *len = st.st_size;
+    return (const uint8_t*)data;
+}
+
+CSInvertedIndex::~CSInvertedIndex() {
+    if (this->_inv)
+        munmap((void*)this->_inv, this->_inv_len);
+    if (this->_post)
+        munmap((void*)this->_post, this->_post_len);
+}
+
+bool CSInvertedIndex::open(const char* db_path) {
+    // cscope puts the index in the same directory as the database
+    std::string dir = db_path;
+    dir.erase(dir.find_last_of('/') + 1);
+
+    this->_inv = mapFile(dir + "cscope.in.out", &this->_inv_len);
+    this->_post = mapFile(dir + "cscope.po.out", &this->_post_len);
+    if (!this->_inv || !this->_post || this->_inv_len < sizeof(CSInvParam))
+        return false;
+
+    auto param = readAt<CSInvParam>(this->_inv);
+    if (param.version != inv_version || param.sizeblk <= 0 ||
+        param.startbyte < 0 || param.supsize < (long)sizeof(long) ||
+        param.cntlsize < 0 ||
+        (size_t)(param.startbyte + param.supsize) > this->_inv_len)
+        return false;
+
+    this->_fingers = this->_inv + param.startbyte;
+    this->_fingers_len = param.supsize;
+    this->_n_blocks = readAt<long>(this->_fingers);
+    this->_blocks_start = param.cntlsize;
+    this->_block_size = param.sizeblk;
+    return this->_n_blocks > 0 &&
+           this->_n_blocks <= (this->_fingers_len - sizeof(long)) /
+                                  sizeof(long) &&
+           this->_blocks_start + this->_n_blocks * this->_block_size <=
+               this->_inv_len;
+}
+
+// The first term of logical block 'i'
+std::string_view CSInvertedIndex::fingerTerm(size_t i) const {
+    size_t off = readAt<long>(this->_fingers + (i + 1) * sizeof(long));
+    if (off >= this->_fingers_len)
+        return "";
+    auto term = (const char*)this->_fingers + off;
+    return std::string_view(term, strnlen(term, this->_fingers_len - off));
+}
+
+std::vector<CSPosting> CSInvertedIndex::find(std::string_view term) const {
+    std::vector<CSPosting> postings;
+
+    // Find the last logical block starting at or before 'term'
+    size_t lo = 0, hi = this->_n_blocks;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (fingerTerm(mid) <= term)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    const uint8_t* block = this->_inv + this->_blocks_start +
+                           lo * this->_block_size;
+
+    // Search the block's entries, which are sorted by term
+    size_t header = 3 * sizeof(long);
+    size_t n_entries = readAt<long>(block);
+    if (n_entries > (this->_block_size - header) / sizeof(CSInvEntry))
+        return postings;
+    lo = 0, hi = n_entries;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        auto e = readAt<CSInvEntry>(block + header + mid * sizeof(CSInvEntry));
+        size_t padded =
+            (e.size + sizeof(long) - 1) / sizeof(long) * sizeof(long);
+        if (e.offset < 0 ||
+            e.offset + padded + sizeof(long) > this->_block_size)
+            return postings;
+
+        std::string_view entry((const char*)block + e.offset, e.size);
+        if (entry < term) {
+            lo = mid + 1;
+        } else if (term < entry) {
+            hi = mid;
+        } else {
+            size_t post_off = readAt<long>(block + e.offset + padded);
+            if (e.post < 0 || post_off > this->_post_len ||
+                (size_t)e.post >
+                    (this->_post_len - post_off) / sizeof(CSInvPosting))
+                return postings;
+
+            for (long i = 0; i < e.post; ++i) {
+                auto p = readAt<CSInvPosting>(this->_post + post_off +
+                                              i * sizeof(CSInvPosting));
+                postings.push_back({(size_t)p.lineoffset, (char)p.type});
+            }
+            break;
+        }
+    }
+    return postings;
+}
+
+// Loads the file records a query reaches, one lookup in the inverted index at
+// a time.  A function's entry in the database comes from its first
+// definition in the first file defining it, just as when everything is
+// loaded, so queries give the same answers either way.
+template <typename Index>
+struct CSIndexLoader {
+    const Index& index;
+    const uint8_t* data;
+    size_t data_len;
+    size_t syms_start;
+    size_t syms_end;
+    CSFileBuilder& builder;
+    bool skip_scan;
+
+    // Parsed file records by offset, as indexes in the builder's files
+    static constexpr size_t no_file = SIZE_MAX;
+    std::unordered_map<size_t, size_t> records;
+
+    // Each function's database entry, or cs_no_sym if it is never defined
+    std::unordered_map<CSNameId, CSSymIdx> defs;
+
+    // Parse the file record starting at 'rec', once
+    size_t record(size_t rec) {
+        auto it = records.find(rec);
+        if (it != records.end())
+            return it->second;
+
+        size_t n_files = builder.files.size();
+        extractSymbols(data, rec, nextFileRecord(data, rec + 1, syms_end),
+                       data_len, skip_scan, builder);
+        builder.finish();
+        size_t file = builder.files.size() > n_files ? n_files : no_file;
+        records[rec] = file;
+        return file;
+    }
+
+    // The definition the database uses for 'fn'
+    CSSymIdx resolve(CSNameId fn) {
+        auto it = defs.find(fn);
+        if (it != defs.end())
+            return it->second;
+
+        // File records are in database order, so the first definition is
+        // the one at the lowest offset
+        size_t first = data_len;
+        for (const CSPosting& p : index.find(builder.symbols.name(fn)))
+            if (p.mark == CS_FN_DEF)
+                first = std::min(first, p.line_offset);
+
+        size_t file = first < syms_end
+                          ? record(fileRecordAt(data, syms_start, first))
+                          : no_file;
+        CSSymIdx def = cs_no_sym;
+        if (file != no_file) {
+            const CSFile& f = builder.files[file];
+            for (CSSymIdx i = f.syms_begin; i < f.syms_end; ++i) {
+                if (builder.syms[i].mark == CS_FN_DEF &&
+                    builder.syms[i].id == fn) {
+                    def = i;
+                    break;
+                }
+            }
+        }
+        defs[fn] = def;
+        return def;
+    }
+
+    // The functions whose database entry calls 'fn'
+    std::vector<CSNameId> callers(CSNameId fn) {
+        std::vector<CSNameId> found;
+        std::vector<size_t> recs;
+        for (const CSPosting& p : index.find(builder.symbols.name(fn)))
+            if (p.mark == CS_FN_CALL && p.line_offset < syms_end)
+                recs.push_back(fileRecordAt(data, syms_start, p.line_offset));
+        std::sort(recs.begin(), recs.end());
+        recs.erase(std::unique(recs.begin(), recs.end()), recs.end());
+
+        for (size_t rec : recs) {
+            size_t file = record(rec);
+            if (file == no_file)
+                continue;
+
+            // Resolving may parse more records, so the symbols are looked up
+            // again each time
+            for (CSSymIdx i = builder.files[file].syms_begin;
+                 i < builder.files[file].syms_end; ++i) {
+                if (builder.syms[i].mark != CS_FN_DEF ||
+                    !hasCallee(builder.syms, i, fn))
+                    continue;
+                CSSymIdx entry = resolve(builder.syms[i].id);
+                if (entry != cs_no_sym && hasCallee(builder.syms, entry, fn))
+                    found.push_back(builder.syms[entry].id);
+            }
+        }
+        std::sort(found.begin(), found.end());
+        found.erase(std::unique(found.begin(), found.end()), found.end());
+        return found;
+    }
+
+    // Resolve every function within 'depth' calls of 'fn', in the direction
+    // 'next' follows
+    template <typename Next>
+    void expand(CSNameId fn, int depth, Next next) {
+        // A bitmap of the functions seen, grown as loaded records name new ones
+        std::vector<CSNameId> frontier = {fn}, upcoming;
+        std::vector<uint64_t> seen;
+        auto claim = [&](CSNameId id) {
+            if (id / 64 >= seen.size())
+                seen.resize(id / 64 + 1);
+            uint64_t bit = 1ull << (id % 64);
+            bool fresh = !(seen[id / 64] & bit);
+            seen[id / 64] |= bit;
+            return fresh;
+        };
+        claim(fn);
+        for (; depth > 0 && !frontier.empty(); --depth) {
+            for (CSNameId id : frontier)
+                for (CSNameId n : next(id))
+                    if (claim(n))
+                        upcoming.push_back(n);
+            frontier.swap(upcoming);
+            upcoming.clear();
+        }
+    }
+};
+
+// Collects the part of a CSPrescan found in one chunk
+struct CSPrescanSink {
+    const uint8_t* data;
+    bool compressed;
+    std::vector<size_t> records;
+    std::vector<CSPrescan::Def> defs;
+    std::vector<CSPrescan::Call> calls;  // Records relative to the chunk
+    bool in_function = false;  // Calls before any definition are dropped
+    std::string expanded;
+
+    uint32_t hash(std::string_view name) {
+        if (compressed)
+            name = expandDigraphs(name, expanded);
+        return std::hash<std::string_view>()(name);
+    }
+
+    void file(std::string_view name, char) {
+        records.push_back(name.data() - (const char*)data);
+        in_function = false;
+    }
+
+    void symbol(std::string_view name, char mark, long) {
+        if (mark == CS_FN_DEF && !records.empty()) {
+            in_function = true;
+            defs.push_back(
+                {hash(name), (size_t)(name.data() - (const char*)data)});
+        } else if (mark == CS_FN_CALL && in_function) {
+            calls.push_back({hash(name), (uint32_t)records.size() - 1});
+        }
+    }
+};
+
+void CSPrescan::scan(const uint8_t* data,
+                     size_t start,
+                     size_t end,
+                     size_t data_len,
+                     unsigned jobs,
+                     bool compressed) {
+    this->_data = data;
+    this->_data_len = data_len;
+    this->_compressed = compressed;
+    std::vector<size_t> bounds = chunkBounds(data, start, end, jobs);
+    std::vector<CSPrescanSink> sinks(bounds.size(), {data, compressed});
+    parallelFor(bounds.size(), jobs, [&](size_t i) {
+        size_t chunk_end = i + 1 < bounds.size() ? bounds[i + 1] : end;
+        skipScanSymbols(data, bounds[i], chunk_end, data_len, sinks[i]);
+    });
+
+    // Number the records across the chunks, then bucket everything in
+    // database order, so that the first definition found is the first
+    std::vector<std::vector<Def>> defs(sinks.size());
+    std::vector<std::vector<Call>> calls(sinks.size());
+    for (size_t i = 0; i < sinks.size(); ++i) {
+        uint32_t base = this->_records.size();
+        for (Call& call : sinks[i].calls)
+            call.record += base;
+        this->_records.insert(this->_records.end(), sinks[i].records.begin(),
+                              sinks[i].records.end());
+        defs[i] = std::move(sinks[i].defs);
+        calls[i] = std::move(sinks[i].calls);
+    }
+    this->_defs.build(defs);
+    this->_calls.build(calls);
+}
+
+std::vector<CSPosting> CSPrescan::find(std::string_view term) const {
+    std::vector<CSPosting> postings;
+    uint32_t hash = std::hash<std::string_view>()(term);
+
+    // Other names may share the hash, so the definition's name is checked
+    std::string expanded;
+    for (const Def& def : this->_defs.bucket(hash)) {
+        if (def.hash != hash)
+            continue;
+        auto name = (const char*)this->_data + def.offset;
+        auto nl = (const char*)memchr(name, '\n', this->_data_len - def.offset);
+        std::string_view found(name, nl ? nl - name
+                                        : this->_data_len - def.offset);
+        if (this->_compressed)
+            found = expandDigraphs(found, expanded);
+        if (found == term) {
+            postings.push_back({def.offset, CS_FN_DEF});
+            break;
+        }
+    }
+
+    // Records calling another name of the same hash are parsed for nothing.
+    // A record's calls are next to each other, it is only given once.
+    size_t last = SIZE_MAX;
+    for (const Call& call : this->_calls.bucket(hash)) {
+        if (call.hash == hash && call.record != last) {
+            last = call.record;
+            postings.push_back({this->_records[call.record], CS_FN_CALL});
+        }
+    }
+    return postings;
+}
+
+// Load only the file records that 'query' reaches, looking symbols up in
+// 'index', and collect their database entries
+template <typename Index>
+void CS::loadRecords(const Index& index, const CSQuery& query) {
+    this->_pools.resize(1);
+    std::vector<CSFile> files;
+    std::vector<CSSym> syms;
+    CSFileBuilder builder = {files,
+                             syms,
+                             this->_pools[0],
+                             this->symbols,
+                             !this->_opts.keep_mapped,
+                             this->_hdr.compression};
+    CSIndexLoader<Index> loader = {
+        index,
+        this->_data,
+        this->_data_len,
+        this->_hdr.syms_start,
+        std::min(this->_hdr.trailer, this->_data_len),
+        builder,
+        this->_opts.skip_scan};
+
+    // The query names a function whether or not the database has it
+    CSNameId fn = this->symbols.find(query.fn_name);
+    if (fn == cs_no_name)
+        fn = this->symbols.add(this->_pools[0].copy(query.fn_name));
+
+    if (query.callees) {
+        loader.expand(fn, query.depth, [&](CSNameId id) {
+            std::vector<CSNameId> callees;
+            CSSymIdx def = loader.resolve(id);
+            if (def != cs_no_sym)
+                for (const CSSym& callee : ::getCallees(syms, def))
+                    callees.push_back(callee.id);
+            return callees;
+        });
+    }
+    if (query.callers) {
+        loader.expand(fn, query.depth,
+                      [&](CSNameId id) { return loader.callers(id); });
+    }
+
+    // Keep the loaded files and their symbols in database order
+    std::vector<std::pair<size_t, size_t>> records(loader.records.begin(),
+                                                   loader.records.end());
+    std::sort(records.begin(), records.end());
+    std::vector<CSSymIdx> moved_to(files.size());
+    for (auto [rec, file] : records) {
+        if (file == loader.no_file)
             continue;
+        CSFile f = files[file];
+        moved_to[file] = this->syms.size();
+        for (CSSymIdx i = f.syms_begin; i < f.syms_end; ++i) {
+            this->syms.push_back(syms[i]);
+            this->syms.back().file = this->files.size();
+        }
+        f.syms_begin = moved_to[file];
+        f.syms_end = this->syms.size();
+        this->files.push_back(f);
+    }
+    this->_n_functions += builder.n_functions;
+
+    this->_db.assign(this->symbols.size(), cs_no_sym);
+    for (auto [id, def] : loader.defs) {
+        if (def != cs_no_sym) {
+            const CSFile& f = files[syms[def].file];
+            this->_db[id] = moved_to[syms[def].file] + (def - f.syms_begin);
+        }
+    }
+}
+
+// Load only what 'query' needs, found through the inverted index instead of
+// parsing the whole symbol section.  Returns false when the database has no
+// usable index.
+bool CS::loadIndexed(const CSQuery& query) {
+    CSInvertedIndex index;
+    if (!this->_hdr.inverted_index || !this->_name || !this->_data ||
+        !index.open(this->_name)) {
+        ERR("No usable inverted index");
+        return false;
+    }
+
+    startSpinner("Loading from the inverted index",
+                 "Loaded from the inverted index");
+    loadRecords(index, query);
+    stopSpinner();
+    return true;
+}
+
+// Load only what 'query' needs, found by a pre-scan of the symbol section.
+// Returns false when the database is not mapped.
+bool CS::loadLazy(const CSQuery& query) {
+    if (!this->_data)
+        return false;
+
+    startSpinner("Loading the files the query reaches",
+                 "Loaded the files the query reaches");
+    CSPrescan prescan;
+    prescan.scan(this->_data, this->_hdr.syms_start,
+                 std::min(this->_hdr.trailer, this->_data_len),
+                 this->_data_len, this->_opts.jobs, this->_hdr.compression);
+    loadRecords(prescan, query);
+    stopSpinner();
+    return true;
+}
+
+// Time every scanning kernel this CPU can run over the database in 'fp'
+static void benchScanKernels(FILE* fp) {
+    struct stat st;
+
+    fstat(fileno(fp), &st);
+    auto data = (const uint8_t*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                                     fileno(fp), 0);
+    if (data == MAP_FAILED) {
+        std::cerr << "Error memory maping cscope database" << std::endl;
+        exit(errno);
+    }
+    const uint8_t* end = data + st.st_size;
+
+    // Repeat 'count' over the whole database for at least half a second
+    auto bench = [&](const char* kernel, const char* impl, auto count) {
+        using clock = std::chrono::steady_clock;
+        auto start = clock::now();
+        std::chrono::duration<double> elapsed;
+        size_t passes = 0, found;
+        do {
+            found = count();
+            ++passes;
+            elapsed = clock::now() - start;
+        } while (elapsed.count() < 0.5);
+
+        double bytes = (double)passes * st.st_size;
+        fprintf(stderr, "%-8s %-7s %7.2f GB/s (%zu found)\n", kernel, impl,
+                bytes / elapsed.count() / 1e9, found);
+    };
+
+    for (const CSScanKernels& k : availableScanKernels()) {
+        bench("newline", k.name, [&]() {
+            size_t n = 0;
+            for (const uint8_t* p = data; (p = k.findNewline(p, end)) < end;
+                 ++p)
+                ++n;
+            return n;
+        });
+        bench("mark", k.name, [&]() {
+            size_t n = 0;
+            for (const uint8_t* p = data;
+                 (p = k.findMark(p, end, all_marks)) < end; ++p)
+                ++n;
+            return n;
+        });
+    }
+
+    munmap((void*)data, st.st_size);
+}
+
+// Time reading the database at 'path' through each backend, counting its
+// lines.  Reads are usually served from the page cache after the first.
+static void benchBackends(const char* path) {
+    for (int b = 0; b < CS_BACKEND_COUNT; ++b) {
+        FILE* fp = fopen(path, "r");
+        struct stat st;
+        if (!fp || fstat(fileno(fp), &st) == -1) {
+            ERR("Could not open %s", path);
+            return;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        const char* name = cs_backend_names[b];
+        size_t lines = 0;
+        auto count = [&](const uint8_t* p, const uint8_t* end) {
+            for (; (p = scan.findNewline(p, end)) < end; ++p)
+                ++lines;
+        };
+
+        std::unique_ptr<CSSource> source;
+        if (b == CS_MMAP) {
+            auto data = (const uint8_t*)mmap(NULL, st.st_size, PROT_READ,
+                                             MAP_PRIVATE | MAP_POPULATE,
+                                             fileno(fp), 0);
+            fclose(fp);
+            if (data == MAP_FAILED)
+                continue;
+            madvise((void*)data, st.st_size, MADV_SEQUENTIAL);
+            count(data, data + st.st_size);
+            munmap((void*)data, st.st_size);
+        } else {
+#ifdef CS_HAVE_URING
+            if (b == CS_URING)
+                source = CSUringSource::open(fp, st.st_size);
+#endif
+            if (!source && b == CS_URING) {
+                fclose(fp);
+                fprintf(stderr, "%-8s %-7s unavailable\n", "read", name);
+                continue;
+            }
+            if (!source)
+                source = std::make_unique<CSPreadSource>(fp, st.st_size);
+
+            auto buf = std::make_unique<uint8_t[]>(1024 * 1024);
+            size_t n;
+            while ((n = source->read(buf.get(), 1024 * 1024)) > 0)
+                count(buf.get(), buf.get() + n);
+            source.reset();
         }
 
-        // Add the file to the list of files
-        this->files.push_back(file);
-        this->_n_functions += file->getFunctionCount();
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        fprintf(stderr, "%-8s %-7s %7.2f GB/s (%zu found)\n", "read", name,
+                st.st_size / elapsed.count() / 1e9, lines);
+    }
+}
+
+// One query of a batch
+struct CSBatchQuery {
+    std::string fn_name;
+    bool callers;
+    bool callees;
+    int depth;
+    std::string output;
+};
+
+// Read batch queries from 'in', one per line:
+//     <function_name> <callers|callees|both> <depth|all> <output_file>
+// Empty lines and lines starting with # are skipped.
+static bool readBatch(FILE* in, std::vector<CSBatchQuery>& queries) {
+    char* line = nullptr;
+    size_t cap = 0;
+    bool ok = true;
+    for (int lineno = 1; ok && getline(&line, &cap, in) != -1; ++lineno) {
+        const char* sep = " \t\r\n";
+        char* fn_name = strtok(line, sep);
+        if (!fn_name || fn_name[0] == '#')
+            continue;
+        char* direction = strtok(NULL, sep);
+        char* depth = strtok(NULL, sep);
+        char* output = strtok(NULL, sep);
+
+        CSBatchQuery query;
+        ok = direction && depth && output && !strtok(NULL, sep);
+        if (ok) {
+            query.fn_name = fn_name;
+            query.callers = !strcmp(direction, "callers") ||
+                            !strcmp(direction, "both");
+            query.callees = !strcmp(direction, "callees") ||
+                            !strcmp(direction, "both");
+            query.depth = strcmp(depth, "all") ? atoi(depth) : cs_unbounded;
+            query.output = output;
+            ok = (query.callers || query.callees) && query.depth > 0;
+        }
+        if (ok)
+            queries.push_back(query);
+        else
+            std::cerr << "Bad query on line " << lineno << std::endl;
     }
+    free(line);
+    return ok;
+}
+
+// Write the edges 'edges' as a digraph, unless there are none
+static void writeDigraph(FILE* out,
+                         const char* title,
+                         const char* fn_name,
+                         const std::string& edges) {
+    if (edges.length() > 0)
+        fprintf(out, "digraph \"%s %s\" {\n%s}\n", title, fn_name,
+                edges.c_str());
+}
+
+// Answer 'queries' on 'jobs' threads, each query on one of them.  Each
+// query writes its own output file, as a single query would.
+static bool runBatch(const CS& cs,
+                     const std::vector<CSBatchQuery>& queries,
+                     unsigned jobs) {
+    std::atomic<bool> ok = true;
+    parallelFor(queries.size(), jobs, [&](size_t i) {
+        const CSBatchQuery& query = queries[i];
+        FILE* out = fopen(query.output.c_str(), "w");
+        if (out == NULL) {
+            fprintf(stderr, "Error opening output file %s: %s\n",
+                    query.output.c_str(), strerror(errno));
+            ok = false;
+            return;
+        }
+        std::vector<CSNameId> fns = cs.findFunctions(query.fn_name);
+        const char* name = query.fn_name.c_str();
+        if (query.callers)
+            writeDigraph(out, "Callers to", name,
+                         cs.getCallers(fns, query.depth, 1));
+        if (query.callees)
+            writeDigraph(out, "Callees of", name,
+                         cs.getCallees(fns, query.depth, 1));
+        fclose(out);
+    });
+    return ok;
 }
 
 static void usage(const char* execname) {
     std::cerr
         << "Usage: " << execname
-        << " function_name [i input_file] [o output_file] [d depth] [x|y]\n"
+        << " function_name [i input_file] [o output_file] [d depth] [j jobs] "
+           "[r backend] [m] [q] [l] [s] [b] [x|y] [e] "
+           "[p function [k count] [a]]\n"
+           "  function_name: Function to graph.  Ending it in * graphs every\n"
+           "                 function whose name starts with the rest.\n"
+           "                 @query_file instead runs\n"
+           "                 the queries in query_file, or in stdin for @-,\n"
+           "                 in parallel.  Each line of it holds:\n"
+           "                 function_name callers|callees|both depth "
+           "output_file\n"
            "  i input_file:  cscope database file, defaults to using stdin\n"
-           "  d depth:       Depth of traversal, defaults to 5\n"
+           "  d depth:       Depth of traversal, defaults to 5.  all follows "
+           "every\n"
+           "                 call, with each cycle drawn once as a cluster\n"
+           "  j jobs:        Parse and traversal threads, defaults to the CPU "
+           "count\n"
+           "  r backend:     How to read input_file: mmap (default), pread or\n"
+           "                 uring.  pread and uring parse as they read\n"
+           "  m:             Keep the database mapped, names are not copied\n"
+           "  q:             Load only what the query needs, using the\n"
+           "                 inverted index built by cscope -q\n"
+           "  l:             Parse only the files the query reaches, found\n"
+           "                 by a quick scan of the database.  Faster when\n"
+           "                 the query reaches a small part of the graph\n"
+           "  s:             Skip straight from one function mark to the\n"
+           "                 next instead of parsing every line\n"
+           "  b:             Benchmark the scan kernels and backends on\n"
+           "                 input_file\n"
            "  o output_file: File to write results to, defaults to stdout\n"
            "  x:             Do not print callers of function_name\n"
-           "  y:             Do not print callees of function_name\n";
+           "  y:             Do not print callees of function_name\n"
+           "  e:             Graph every function that function_name matches\n"
+           "                 as an extended regular expression\n"
+           "  p function:    Print the shortest call chains from\n"
+           "                 function_name to function instead\n"
+           "  k count:       With p, print the count shortest chains that\n"
+           "                 repeat no function, one per line.  A depth given\n"
+           "                 with d limits their calls\n"
+           "  a:             With p, print the chains that repeat no function\n"
+           "                 depth first instead, up to k (100 by default),\n"
+           "                 of at most depth calls\n";
     exit(EXIT_FAILURE);
 }
 
@@ -578,13 +3770,27 @@ int main(int argc, char** argv) {
     FILE* out = stdout;
     FILE* in = stdin;
     int depth = 5;
+    int jobs = std::max(1, (int)std::thread::hardware_concurrency());
+    const char* in_name = nullptr;
+    bool keep_mapped = false;
+    bool use_index = false;
+    bool lazy = false;
+    bool skip_scan = false;
+    CSBackend backend = CS_MMAP;
+    bool bench = false;
 
     bool outputSpecified = false;
     bool inputSpecified = false;
     bool depthSpecified = false;
+    bool jobsSpecified = false;
+    bool backendSpecified = false;
 
     bool do_callers = true;
     bool do_callees = true;
+    bool regex = false;
+    const char* path_to = nullptr;
+    size_t n_chains = 0;
+    bool all_chains = false;
 
     for (int i = 2; i < argc; i++) {
         if (strlen(argv[i]) != 1) {
@@ -597,14 +3803,58 @@ int main(int argc, char** argv) {
             do_callers = false;
         } else if (option == 'y') {
             do_callees = false;
+        } else if (option == 'm') {
+            keep_mapped = true;
+        } else if (option == 'q') {
+            use_index = true;
+        } else if (option == 'l') {
+            lazy = true;
+        } else if (option == 's') {
+            skip_scan = true;
+        } else if (option == 'b') {
+            bench = true;
+        } else if (option == 'e') {
+            regex = true;
+        } else if (option == 'p' && haveExtraArg && !path_to) {
+            i++;
+            path_to = argv[i];
+        } else if (option == 'k' && haveExtraArg && !n_chains) {
+            i++;
+            long n = atol(argv[i]);
+            if (n <= 0) {
+                std::cerr << "Chains must be greater than 0" << std::endl;
+                return EXIT_FAILURE;
+            }
+            n_chains = n;
+        } else if (option == 'a') {
+            all_chains = true;
         } else if (option == 'd' && haveExtraArg && !depthSpecified) {
             depthSpecified = true;
             i++;
-            depth = atoi(argv[i]);
+            depth = strcmp(argv[i], "all") ? atoi(argv[i]) : cs_unbounded;
             if (depth <= 0) {
                 std::cerr << "Depth must be greater than 0" << std::endl;
                 return EXIT_FAILURE;
             }
+        } else if (option == 'j' && haveExtraArg && !jobsSpecified) {
+            jobsSpecified = true;
+            i++;
+            jobs = atoi(argv[i]);
+            if (jobs <= 0) {
+                std::cerr << "Jobs must be greater than 0" << std::endl;
+                return EXIT_FAILURE;
+            }
+        } else if (option == 'r' && haveExtraArg && !backendSpecified) {
+            backendSpecified = true;
+            i++;
+            auto found = std::find_if(
+                std::begin(cs_backend_names), std::end(cs_backend_names),
+                [&](const char* name) { return !strcmp(name, argv[i]); });
+            if (found == std::end(cs_backend_names)) {
+                std::cerr << "Unknown backend `" << argv[i] << "`" << std::endl;
+                usage(argv[0]);
+            }
+            backend = (CSBackend)(found - std::begin(cs_backend_names));
         } else if (option == 'o' && haveExtraArg && !outputSpecified) {
             outputSpecified = true;
             i++;
@@ -618,6 +3868,7 @@ int main(int argc, char** argv) {
         } else if (option == 'i' && haveExtraArg && !inputSpecified) {
             inputSpecified = true;
             i++;
+            in_name = argv[i];
             in = fopen(argv[i], "r");
             if (in == NULL) {
                 std::cerr << "Could not open cscope database file called `"
@@ -630,27 +3881,122 @@ int main(int argc, char** argv) {
         }
     }
 
+    if (bench) {
+        benchScanKernels(in);
+        if (in_name)
+            benchBackends(in_name);
+        return 0;
+    }
+
+    // A batch of queries instead of one, from a file or from stdin
+    const char* func_name = argv[1];
+    std::vector<CSBatchQuery> batch;
+    bool batched = func_name[0] == '@';
+    if (batched) {
+        bool from_stdin = !strcmp(func_name + 1, "-");
+        if (from_stdin && in == stdin) {
+            std::cerr << "Queries and the database cannot both come from "
+                         "stdin"
+                      << std::endl;
+            return EXIT_FAILURE;
+        }
+        FILE* queries = from_stdin ? stdin : fopen(func_name + 1, "r");
+        if (queries == NULL) {
+            std::cerr << "Could not open query file called `"
+                      << func_name + 1 << "`" << std::endl;
+            return errno;
+        }
+        if (!readBatch(queries, batch))
+            return EXIT_FAILURE;
+        if (!from_stdin)
+            fclose(queries);
+
+        // The whole database is needed to answer any query
+        use_index = false;
+        lazy = false;
+    }
+
+    // A pattern names many functions, so the whole database is needed
+    bool pattern = regex || isPrefixPattern(func_name);
+    CSRegex re;
+    if (pattern && path_to) {
+        std::cerr << "Call chains need a single function" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (pattern) {
+        std::string error;
+        if (regex && !re.compile(func_name, error)) {
+            std::cerr << "Bad regular expression `" << func_name
+                      << "`: " << error << std::endl;
+            return EXIT_FAILURE;
+        }
+        use_index = false;
+        lazy = false;
+    }
+
     // Load
-    CS* cs = new CS(in);
+    CSOptions opts;
+    opts.jobs = jobs;
+    opts.keep_mapped = keep_mapped;
+    opts.use_index = use_index;
+    opts.lazy = lazy;
+    opts.backend = backend;
+    opts.skip_scan = skip_scan;
+    CS* cs = new CS(in, in_name, opts);
+    if (batched) {
+        cs->load({"", 0, false, false});
+        startSpinner("Running queries", "Ran queries");
+        bool ok = runBatch(*cs, batch, jobs);
+        stopSpinner();
+        return ok ? 0 : EXIT_FAILURE;
+    }
+    if (path_to)
+        cs->load({func_name, cs_unbounded, false, true});
+    else
+        cs->load({func_name, depth, do_callers, do_callees});
+    CSNameId fn = cs->findFunction(func_name);
+    std::vector<CSNameId> fns;
+    if (pattern) {
+        auto start = std::chrono::steady_clock::now();
+        fns = regex ? cs->findMatching(re) : cs->findFunctions(func_name);
+        if (logging) {
+            std::chrono::duration<double, std::milli> ms =
+                std::chrono::steady_clock::now() - start;
+            std::cout << std::format("Matched {} functions in {:.1f} ms",
+                                     fns.size(), ms.count())
+                      << std::endl;
+        }
+    } else if (fn != cs_no_name) {
+        fns.push_back(fn);
+    }
 
     // Go!
-    const char* func_name = argv[1];
+    if (path_to) {
+        startSpinner("Finding call chains", "Found call chains");
+        CSNameId to = cs->findFunction(path_to);
+        std::string paths =
+            n_chains || all_chains
+                ? cs->getChains(fn, to, n_chains ? n_chains : 100,
+                                depthSpecified || all_chains ? depth
+                                                             : cs_unbounded,
+                                all_chains)
+                : cs->getPaths(fn, to);
+        if (paths.length() > 0) {
+            fprintf(out, "digraph \"Calls from %s to %s\" {\n%s}\n",
+                    func_name, path_to, paths.c_str());
+        }
+        stopSpinner();
+        fclose(out);
+        return 0;
+    }
     if (do_callers) {
         startSpinner("Building callers", "Built callers");
-        std::string callers = getCallersRec(cs->db, func_name, depth);
-        if (callers.length() > 0) {
-            fprintf(out, "digraph \"Callers to %s\" {\n%s}\n", func_name,
-                    callers.c_str());
-        }
+        writeDigraph(out, "Callers to", func_name, cs->getCallers(fns, depth));
         stopSpinner();
     }
     if (do_callees) {
         startSpinner("Building callees", "Built callees");
-        std::string callees = getCalleesRec(cs->db, func_name, depth);
-        if (callees.length() > 0) {
-            fprintf(out, "digraph \"Callees of %s\" {\n%s}\n", func_name,
-                    callees.c_str());
-        }
+        writeDigraph(out, "Callees of", func_name, cs->getCallees(fns, depth));
         stopSpinner();
     }
 